@@ -0,0 +1,239 @@
+/* crc.c -- CRC-32 shared by compression and decompression
+
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ * Three kernels compute the same CRC-32 (the gzip polynomial, reflected,
+ * pre- and post-inverted):
+ *
+ *   bytewise  one table lookup per byte, as the old updcrc did.
+ *   slice16   sixteen tables, one lookup per input byte but no serial
+ *             dependency between the lookups of a 16-byte word.
+ *   pclmul    carry-less multiply folding of four 128-bit lanes
+ *             (x86-64 with PCLMULQDQ and SSE4.1), as in Intel's "Fast CRC
+ *             Computation for Generic Polynomials Using PCLMULQDQ".
+ *
+ * Internally the kernels work on the inverted register; crc32_update
+ * does the inversion once per call.
+ */
+
+#include <config.h>
+#include <pthread.h>
+#include <string.h>
+#include "crc.h"
+
+#if defined __x86_64__ && defined __GNUC__
+# define CRC_PCLMUL 1
+# include <immintrin.h>
+#endif
+
+// Reflected CRC-32 polynomial.
+#define POLY 0xedb88320U
+
+// crc_table[0] is the usual byte-at-a-time table; crc_table[k][n] is
+// the CRC of byte n followed by k zero bytes.
+static uint32_t crc_table[16][256];
+
+static crc32_fn crc_impl;
+static char const *crc_impl_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_tables (void)
+{
+  for (unsigned n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    crc_table[0][n] = c;
+  }
+  for (unsigned n = 0; n < 256; n++)
+    for (int k = 1; k < 16; k++)
+      crc_table[k][n] = (crc_table[k - 1][n] >> 8)
+                        ^ crc_table[0][crc_table[k - 1][n] & 0xff];
+}
+
+static uint32_t crc32_bytewise (uint32_t c, unsigned char const *buf,
+                                size_t len)
+{
+  while (len--)
+    c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+  return c;
+}
+
+static uint32_t crc32_slice16 (uint32_t c, unsigned char const *buf,
+                               size_t len)
+{
+#ifndef WORDS_BIGENDIAN
+  while (len >= 16) {
+    uint32_t w[4];
+    memcpy (w, buf, sizeof w);
+    w[0] ^= c;
+    c = crc_table[15][w[0] & 0xff] ^ crc_table[14][(w[0] >> 8) & 0xff]
+        ^ crc_table[13][(w[0] >> 16) & 0xff] ^ crc_table[12][w[0] >> 24]
+        ^ crc_table[11][w[1] & 0xff] ^ crc_table[10][(w[1] >> 8) & 0xff]
+        ^ crc_table[9][(w[1] >> 16) & 0xff] ^ crc_table[8][w[1] >> 24]
+        ^ crc_table[7][w[2] & 0xff] ^ crc_table[6][(w[2] >> 8) & 0xff]
+        ^ crc_table[5][(w[2] >> 16) & 0xff] ^ crc_table[4][w[2] >> 24]
+        ^ crc_table[3][w[3] & 0xff] ^ crc_table[2][(w[3] >> 8) & 0xff]
+        ^ crc_table[1][(w[3] >> 16) & 0xff] ^ crc_table[0][w[3] >> 24];
+    buf += 16;
+    len -= 16;
+  }
+#endif
+  return crc32_bytewise (c, buf, len);
+}
+
+static int always (void)
+{
+  return 1;
+}
+
+#ifdef CRC_PCLMUL
+static int have_pclmul (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1");
+}
+
+// Folding constants: x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32)
+// and x^64 mod P, then P and floor(x^64 / P) for the Barrett reduction,
+// all bit-reflected.
+static uint64_t const k1k2[2] __attribute__ ((aligned (16)))
+  = { 0x0154442bd4, 0x01c6e41596 };
+static uint64_t const k3k4[2] __attribute__ ((aligned (16)))
+  = { 0x01751997d0, 0x00ccaa009e };
+static uint64_t const k5k0[2] __attribute__ ((aligned (16)))
+  = { 0x0163cd6124, 0x0000000000 };
+static uint64_t const poly[2] __attribute__ ((aligned (16)))
+  = { 0x01db710641, 0x01f7011641 };
+
+__attribute__ ((target ("pclmul,sse4.1")))
+static uint32_t crc32_pclmul (uint32_t c, unsigned char const *buf,
+                              size_t len)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  if (len < 64)
+    return crc32_slice16 (c, buf, len);
+
+  x1 = _mm_loadu_si128 ((__m128i const *) (buf + 0x00));
+  x2 = _mm_loadu_si128 ((__m128i const *) (buf + 0x10));
+  x3 = _mm_loadu_si128 ((__m128i const *) (buf + 0x20));
+  x4 = _mm_loadu_si128 ((__m128i const *) (buf + 0x30));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 ((int) c));
+  x0 = _mm_load_si128 ((__m128i const *) k1k2);
+  buf += 64;
+  len -= 64;
+
+  // fold four lanes 64 bytes at a time
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5),
+                        _mm_loadu_si128 ((__m128i const *) (buf + 0x00)));
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6),
+                        _mm_loadu_si128 ((__m128i const *) (buf + 0x10)));
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7),
+                        _mm_loadu_si128 ((__m128i const *) (buf + 0x20)));
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8),
+                        _mm_loadu_si128 ((__m128i const *) (buf + 0x30)));
+    buf += 64;
+    len -= 64;
+  }
+
+  // fold the four lanes into one
+  x0 = _mm_load_si128 ((__m128i const *) k3k4);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  // then whatever whole 16-byte words remain
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5),
+                        _mm_loadu_si128 ((__m128i const *) buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  // reduce 128 bits to 64
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+  x0 = _mm_loadl_epi64 ((__m128i const *) k5k0);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128 ((__m128i const *) poly);
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+  c = (uint32_t) _mm_extract_epi32 (x1, 1);
+
+  return crc32_slice16 (c, buf, len);
+}
+#endif
+
+struct crc32_kernel const crc32_kernels[] = {
+  { "bytewise", crc32_bytewise, always },
+  { "slice16", crc32_slice16, always },
+#ifdef CRC_PCLMUL
+  { "pclmul", crc32_pclmul, have_pclmul },
+#endif
+  { NULL, NULL, NULL }
+};
+
+static void crc_init (void)
+{
+  make_tables ();
+  for (struct crc32_kernel const *k = crc32_kernels; k->name; k++)
+    if (k->supported ()) {
+      crc_impl = k->fn;
+      crc_impl_name = k->name;
+    }
+}
+
+uint32_t crc32_update (uint32_t crc, unsigned char const *buf, size_t len)
+{
+  pthread_once (&crc_once, crc_init);
+  return ~crc_impl (~crc, buf, len);
+}
+
+char const *crc32_kernel_name (void)
+{
+  pthread_once (&crc_once, crc_init);
+  return crc_impl_name;
+}
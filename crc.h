@@ -0,0 +1,46 @@
+/* crc.h -- CRC-32 shared by compression and decompression
+
+   Copyright (C) 2018 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t (*crc32_fn) (uint32_t crc, unsigned char const *buf,
+                              size_t len);
+
+/* One CRC-32 implementation.  supported() tells whether this CPU can
+   run it; the list in crc32_kernels is ordered slowest first and ends
+   with a null name.  fn works on the inverted CRC register and relies
+   on tables built by the first call to crc32_update or
+   crc32_kernel_name; it is exported for benchmarks. */
+struct crc32_kernel
+{
+  char const *name;
+  crc32_fn fn;
+  int (*supported) (void);
+};
+
+extern struct crc32_kernel const crc32_kernels[];
+
+/* Continue the gzip CRC-32 crc over buf[0..len-1] and return it.  Start
+   with crc 0; the result is the value stored in the gzip trailer, as
+   with zlib's crc32_z.  The fastest kernel this CPU supports is chosen
+   on first use. */
+uint32_t crc32_update (uint32_t crc, unsigned char const *buf, size_t len);
+
+/* Name of the kernel crc32_update uses. */
+char const *crc32_kernel_name (void);
@@ -22,6 +22,10 @@
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "deflate.h"
 #include "utils.h"
@@ -29,8 +33,7 @@
 #include "deflate.h"
 #include "parallel.h"
 #include "gzip.h"
-
-#define DICT 32768U
+#include "crc.h"
 
 #ifndef WINDOW_BITS
 #  define WINDOW_BITS 15
@@ -40,6 +43,110 @@
 #  define GZIP_ENCODING 16
 #endif
 
+/* Block size policy. With --block-size=auto, the default, the buffers are
+   sized from the input size so that each compression thread gets about
+   JOBS_PER_THREAD blocks, within MIN_BLOCK and MAX_BLOCK and within what
+   the input and output pools can hold in MEMORY_BUDGET, or in the memory
+   limit if one was given (see fit_memory). Input of unknown size is cut
+   into FIXED_BLOCK blocks. The blocks depend on nothing but the input and
+   the options, so the same input always compresses to the same bytes. With
+   --block-size=adaptive the buffers are sized the same way, but the reader
+   fills each block with as much input as the threads compress in about
+   BLOCK_NS, as measured on the blocks done so far, but never more than the
+   buffer holds nor more than the size-based choice, so that small inputs
+   still spread over all threads; where the blocks end then depends on the
+   timing, and so does the output. With --block-size=N every block is N
+   bytes. With --rsyncable
+   the content decides where each block ends (see rsync_cut), and the
+   buffers hold RSYNC_MAX bytes, the longest block it may make. */
+#define MIN_BLOCK (64*1024L)
+#define MAX_BLOCK (4*1024*1024L)
+#define FIXED_BLOCK (128*1024L)
+#define JOBS_PER_THREAD 4
+#define MEMORY_BUDGET (256*1024*1024L)
+#define BLOCK_NS 10000000ULL
+#define RSYNC_MAX (512*1024L)
+
+/* For regular files, the reader asks the kernel to fetch the input
+   READ_AHEAD blocks per thread beyond the block it is filling, so the blocks
+   queued behind it are in the page cache before a worker touches them. */
+#define READ_AHEAD 2
+
+/* Jobs in flight per compression thread: the pools hold this many output
+   spaces per thread, and one more input space than that in all. */
+#define DEPTH 2
+
+/* Round n up to a multiple of 4 KiB. */
+#define PAGE_ROUND(n) (((n) + 4095) & ~4095L)
+
+/* Size of the output buffer for a block of size bytes: the input plus
+   the worst case overhead of deflate's stored blocks, plus room for the
+   sync or finish marker. */
+#define OUTPUT_BOUND(size) \
+  ((size) + ((size) >> 12) + ((size) >> 14) + ((size) >> 25) + 13 + 16)
+
+/* Return the size of the input buffers for a file of size bytes (-1 if
+   unknown) compressed by processes threads, given the requested block size
+   (0 for automatic) and the largest automatic size, limit. Set *target to
+   the initial amount of input per block. */
+static long choose_block_size (off_t size, int processes, long requested,
+                               long limit, long *target)
+{
+  long block;
+
+  if (requested != 0)
+    {
+      *target = requested;
+      return requested;
+    }
+
+  if (size < 0)
+    {
+      *target = FIXED_BLOCK < limit ? FIXED_BLOCK : limit;
+      return limit;
+    }
+
+  block = size / ((off_t) processes * JOBS_PER_THREAD);
+  if (block < MIN_BLOCK)
+    block = MIN_BLOCK;
+  block = PAGE_ROUND (block);
+  if (block > limit)
+    block = limit;
+  *target = block;
+  return block;
+}
+
+/* Return the amount of input to put in the next block: enough to keep a
+   compression thread busy for about BLOCK_NS at the rate measured so far,
+   between MIN_BLOCK and max. Keep the current target until every thread
+   has reported a block. */
+static long adapt_block_size (scheduler_t *scheduler, int processes,
+                              long target, long max)
+{
+  uint64_t bytes, ns;
+  unsigned long long want;
+
+  scheduler_rate (scheduler, &bytes, &ns);
+  if (ns == 0 || bytes < (uint64_t) processes * MIN_BLOCK)
+    return target;
+  want = PAGE_ROUND ((long) ((double) bytes / ns * BLOCK_NS));
+  if (want < MIN_BLOCK)
+    want = MIN_BLOCK;
+  if (want > (unsigned long long) max)
+    want = max;
+  return want;
+}
+
+/* Start reading bytes from..to-1 of the file open on fd into the page
+   cache. */
+static void read_ahead (int fd, off_t from, off_t to)
+{
+#ifdef POSIX_FADV_WILLNEED
+  if (to > from)
+    posix_fadvise (fd, from, to - from, POSIX_FADV_WILLNEED);
+#endif
+}
+
 /*
 strm_init(z_stream *strm, int level):
 this function sets the necessary flags and creates the necessary structures to
@@ -65,85 +172,672 @@ static void strm_init (z_stream *strm, int level)
 }
 
 
-int deflate_file_parallel (int input_fd, int output_fd, long block_size,
-			   int processes, int level, char *name, time_t mtime)
+/* Inputs of at most SMALL_FILE bytes (see gzip.h) are compressed as a
+   single block on the calling thread: they would make a single job anyway,
+   and the engine's threads and buffers would cost more than the block. The
+   stream and the output buffer are kept from one small file to the next. */
+static struct
 {
-  //Initialize job queue and memory pools
-  int i;
-  unsigned long seq;
-  job_queue_t *job_queue;
-  job_queue_t *write_job_queue;
-  job_t *prev_job, *job;
-  pool_t *input_pool, *output_pool, *dict_pool;
-  compress_options *c_opts;
-  write_opts *w_opts;
-  pthread_t *pthread_array;
-
-  job_queue = new_job_queue (1, 0);
-  write_job_queue = new_job_queue (processes, 1);
-  input_pool = new_pool (block_size, 2*processes);
-  output_pool = new_pool (block_size, 2*processes);
-  if (!independent)
-      dict_pool = new_pool (DICT, 2*processes);
+  z_stream strm;
+  int ready;                    /* strm has been initialized */
+  unsigned char *out;
+  size_t out_size;
+} small;
+
+/* Compress the rest of the input on input_fd, which should be at most
+   SMALL_FILE bytes, as one gzip stream to output_fd. Return 0 when done, or
+   1 if the input turned out to be larger, after putting the file offset back
+   where it was. */
+int deflate_small (int input_fd, int output_fd, int level, char *name,
+                   time_t mtime)
+{
+  unsigned char in[SMALL_FILE + 1];
+  size_t len, bound;
+  ssize_t got;
+  off_t start;
+  int ret, kind;
+
+  start = lseek (input_fd, 0, SEEK_CUR);
+  len = 0;
+  while (len < sizeof in)
+    {
+      got = read (input_fd, in + len, sizeof in - len);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+        read_error ();
+      if (got == 0)
+        break;
+      len += got;
+    }
+  if (len > SMALL_FILE)
+    {
+      // the file grew since it was stat'ed
+      if (lseek (input_fd, start, SEEK_SET) != start)
+        read_error ();
+      return 1;
+    }
+
+  if (!small.ready)
+    {
+      small.strm.zalloc = Z_NULL;
+      small.strm.zfree = Z_NULL;
+      small.strm.opaque = Z_NULL;
+      if (deflateInit2 (&small.strm, level, Z_DEFLATED, -WINDOW_BITS, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+        exit (EXIT_FAILURE);
+      small.ready = 1;
+    }
   else
-      dict_pool = NULL;
-  seq = 0;
-  prev_job = job = NULL;
+    deflateReset (&small.strm);
+  // incompressible input is stored, by deflate's level 0
+  kind = block_strategy (in, len, strategy);
+  if (kind == STORED_BLOCK)
+    deflateParams (&small.strm, 0, Z_DEFAULT_STRATEGY);
+  else
+    deflateParams (&small.strm, level, kind);
+  bound = deflateBound (&small.strm, len);
+  if (small.out_size < bound)
+    {
+      free (small.out);
+      small.out = Malloc (bound);
+      small.out_size = bound;
+    }
+  small.strm.next_in = in;
+  small.strm.avail_in = len;
+  small.strm.next_out = small.out;
+  small.strm.avail_out = small.out_size;
+  ret = deflate (&small.strm, Z_FINISH);
+  assert (ret == Z_STREAM_END);
+
+  if (write_gzip (output_fd, name, mtime, level, small.out,
+                  small.out_size - small.strm.avail_out, len,
+                  crc32_update (0, in, len)) != 0)
+    write_error ();
+  return 0;
+}
+
+/* The compression threads, the writer thread and their buffers are made
+   when the first file is compressed and kept for the rest of the run, so
+   that compressing many small files does not pay for thread creation and
+   buffer allocation each time. Sequence numbers carry on from one file to
+   the next, and each job points at the file it belongs to, so jobs of
+   several files can be in flight at once. The pools only ever grow: a file
+   that wants bigger blocks than the pools hold replaces them if no other
+   file is in flight, and otherwise makes do with the blocks they hold.
+   With --numa the threads are dealt out to the NUMA nodes in turn, and
+   there is a pair of pools for each node, on that node. */
+static struct engine
+{
+  int processes;                /* threads, fewer than asked to fit memory */
+  int depth;                    /* jobs in flight per thread */
+  long max_block;               /* largest automatic block size */
+  int level;
+  long seq;                     /* sequence number of the next job */
+  long input_size;              /* size of the spaces in input_pools */
+  long output_size;             /* size of the spaces in output_pools */
+  int busy;                     /* files begun and not yet ended */
+  scheduler_t *scheduler;
+  job_queue_t *write_queue;
+  numa_t *numa;                 /* NULL without NUMA placement */
+  int nodes;                    /* nodes threads are placed on, at least 1 */
+  int *workers;                 /* threads on each node */
+  pool_t **input_pools;         /* per node, NULL until a file is read */
+  pool_t **output_pools;        /* per node */
+  compress_options **c_opts;
+  pthread_t *threads;
+  unsigned long long periods;   /* quota periods, as last reported */
+  unsigned long long throttled; /* periods throttled, as last reported */
+  uint64_t throttled_ns;        /* time throttled, as last reported */
+} *engine;
+
+/* Return the most memory an engine of workers threads, dealt out to nodes
+   NUMA nodes, can come to hold with depth jobs in flight per thread and
+   blocks of block bytes: the threads' zlib arenas and every space its pools
+   may make. */
+static unsigned long long engine_memory (int workers, int nodes, int depth,
+                                         long block)
+{
+  unsigned long long total;
+  int n, share;
+
+  if (nodes > workers)
+    nodes = workers;
+  total = (unsigned long long) workers * arena_memory (huge_pages);
+  for (n = 0; n < nodes; ++n)
+    {
+      share = workers / nodes + (n < workers % nodes);
+      total += pool_memory (OUTPUT_BOUND (block), depth * share + 1,
+                            huge_pages)
+               + pool_memory (block, depth * share + 2, huge_pages);
+    }
+  return total;
+}
+
+/* Return the least --memory-limit that the engine fits in, with blocks of
+   block_size bytes (0 or ADAPTIVE_BLOCK for automatic). */
+long deflate_min_memory (long block_size)
+{
+  return engine_memory (1, 1, 1, block_size > 0 ? block_size : MIN_BLOCK);
+}
+
+/* Choose e's thread count, jobs in flight per thread and largest automatic
+   block size for processes threads and the requested block size (0 for
+   automatic). Without --memory-limit every thread is started with DEPTH
+   jobs in flight, and automatic blocks are kept within MEMORY_BUDGET. With
+   it, the engine is made to fit the limit: first by making automatic blocks
+   smaller, down to MIN_BLOCK, then by allowing one job in flight per thread
+   instead of DEPTH, then by starting fewer threads. Whatever the limit leaves
+   over goes to bigger automatic blocks. As the pools never make more spaces
+   than their limits, the reader then waits for spaces to be given back
+   rather than allocate past the budget. */
+static void fit_memory (struct engine *e, int processes, long requested)
+{
+  long least = requested != 0 ? requested : MIN_BLOCK;
+  long lo, hi, mid;
+
+  e->processes = processes;
+  e->depth = DEPTH;
+  if (memory_limit == 0)
+    {
+      e->max_block = MEMORY_BUDGET / (4 * processes);
+      if (e->max_block > MAX_BLOCK)
+        e->max_block = MAX_BLOCK;
+      if (e->max_block < MIN_BLOCK)
+        e->max_block = MIN_BLOCK;
+      return;
+    }
+  while (e->processes > 1
+         && engine_memory (e->processes, e->nodes, e->depth, least)
+            > (unsigned long long) memory_limit)
+    {
+      if (e->depth > 1)
+        e->depth = 1;
+      else
+        e->processes--;
+    }
+  if (e->processes == 1)
+    e->depth = engine_memory (1, 1, DEPTH, least)
+               <= (unsigned long long) memory_limit ? DEPTH : 1;
+  if (requested != 0)
+    {
+      e->max_block = requested;
+      return;
+    }
+  // the largest whole number of pages that fits
+  lo = least / 4096;
+  hi = MAX_BLOCK / 4096;
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (engine_memory (e->processes, e->nodes, e->depth, mid * 4096)
+          <= (unsigned long long) memory_limit)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+  e->max_block = lo * 4096;
+}
 
-  //Create processes # of new threads for compression and 1 for writing
-  pthread_array = Calloc (processes + 1, sizeof(pthread_array));
-  c_opts = new_compress_options (job_queue, write_job_queue, level);
-  w_opts = new_write_options (write_job_queue, output_fd, name, mtime, level);
+/* Return the engine for processes threads at level, starting it if this is
+   the first file. The engine may run fewer threads to fit the memory
+   limit. */
+static struct engine *get_engine (int processes, int level, long block_size)
+{
+  int i;
+  struct engine *e = engine;
 
+  if (e != NULL)
+    {
+      assert (e->level == level);
+      return e;
+    }
+  e = Malloc (sizeof *e);
+  e->numa = numa_aware ? new_numa () : NULL;
+  e->nodes = e->numa != NULL ? numa_nodes (e->numa) : 1;
+  fit_memory (e, processes, block_size);
+  processes = e->processes;
+  e->level = level;
+  e->seq = 0;
+  e->periods = e->throttled = e->throttled_ns = 0;
+  cpu_throttling (&e->periods, &e->throttled, &e->throttled_ns);
+  e->input_size = e->output_size = 0;
+  e->busy = 0;
+  e->scheduler = new_scheduler (processes, e->depth * processes);
+  if (target_rate != 0)
+    scheduler_target (e->scheduler, target_rate, level);
+  e->write_queue = new_job_queue (processes, 1, e->depth * processes);
+  if (io_boost)
+    scheduler_boost (e->scheduler, e->write_queue, level);
+  if (e->nodes > processes)
+    e->nodes = processes;
+  e->workers = Calloc (e->nodes, sizeof (int));
+  e->input_pools = Calloc (e->nodes, sizeof (pool_t *));
+  e->output_pools = Calloc (e->nodes, sizeof (pool_t *));
+  e->c_opts = Malloc (processes * sizeof (compress_options *));
+  e->threads = Calloc (processes + 1, sizeof (pthread_t));
   for (i = 0; i < processes; ++i)
     {
-      pthread_create(&pthread_array[i], NULL, compress_thread, (void*) c_opts);
+      e->workers[i % e->nodes]++;
+      e->c_opts[i] = new_compress_options (e->scheduler, i, e->write_queue,
+                                           level, strategy, e->numa,
+                                           i % e->nodes, huge_pages);
+      pthread_create (&e->threads[i], NULL, compress_thread, e->c_opts[i]);
     }
-  pthread_create(&pthread_array[i], NULL, write_thread, (void*) w_opts);
+  pthread_create (&e->threads[i], NULL, write_thread, e->write_queue);
+  engine = e;
+  return e;
+}
+
+/* Make sure the engine's output spaces, and its input spaces if the file is
+   to be read rather than mapped, hold buffer_size bytes of input, if no file
+   is in flight. Return the block size the pools allow. */
+static long size_pools (struct engine *e, long buffer_size, int read_input)
+{
+  int n, node;
 
+  // One more output space than jobs in flight: the last job read holds its
+  // space until it is scheduled, which is after the next job is made.
+  if (e->output_size < buffer_size && e->busy == 0)
+    {
+      for (n = 0; n < e->nodes; ++n)
+        {
+          node = e->numa != NULL ? numa_node_id (e->numa, n) : -1;
+          if (e->output_pools[n] != NULL)
+            free_pool (e->output_pools[n]);
+          e->output_pools[n] = new_pool (OUTPUT_BOUND (buffer_size),
+                                         e->depth * e->workers[n] + 1,
+                                         huge_pages, node);
+        }
+      e->output_size = buffer_size;
+    }
+  // Two more input spaces: the last job read holds its own until it is
+  // scheduled, and the input before it as its dictionary until it is
+  // compressed.
+  if (read_input && (e->input_pools[0] == NULL
+                     || (e->input_size < buffer_size && e->busy == 0)))
+    {
+      for (n = 0; n < e->nodes; ++n)
+        {
+          node = e->numa != NULL ? numa_node_id (e->numa, n) : -1;
+          if (e->input_pools[n] != NULL)
+            free_pool (e->input_pools[n]);
+          e->input_pools[n] = new_pool (buffer_size,
+                                        e->depth * e->workers[n] + 2,
+                                        huge_pages, node);
+        }
+      e->input_size = buffer_size;
+    }
+  if (buffer_size > e->output_size)
+    buffer_size = e->output_size;
+  if (read_input && buffer_size > e->input_size)
+    buffer_size = e->input_size;
+  return buffer_size;
+}
+
+/* Free the small file stream, then stop the engine's threads and free it.
+   Leaves the engine alone if there is none, or if a file is still in flight,
+   as when gzip gives up on a read error: the process is about to exit
+   anyway. */
+void deflate_shutdown (void)
+{
+  int i;
+  struct engine *e = engine;
+
+  if (small.ready)
+    {
+      deflateEnd (&small.strm);
+      free (small.out);
+      small.ready = 0;
+      small.out = NULL;
+      small.out_size = 0;
+    }
+  if (e == NULL || e->busy)
+    return;
+  engine = NULL;
+  close_scheduler (e->scheduler);
+  for (i = 0; i < e->processes + 1; ++i)
+    pthread_join (e->threads[i], NULL);
+  for (i = 0; i < e->nodes; ++i)
+    {
+      if (e->input_pools[i] != NULL)
+        free_pool (e->input_pools[i]);
+      free_pool (e->output_pools[i]);
+    }
+  free (e->input_pools);
+  free (e->output_pools);
+  free (e->workers);
+  if (e->numa != NULL)
+    free_numa (e->numa);
+  free_scheduler (e->scheduler);
+  free_job_queue (e->write_queue);
+  for (i = 0; i < e->processes; ++i)
+    free_compress_options (e->c_opts[i]);
+  free (e->c_opts);
+  free (e->threads);
+  free (e);
+}
+
+/* A file whose jobs have all been handed to the engine. */
+struct deflate_file
+{
+  write_opts *w_opts;
+  input_map_t *map;
+  unsigned long jobs;           /* jobs the file was cut into */
+  uint64_t read_ns;             /* time spent waiting for input */
+};
+
+/* Read the input on input_fd and hand it to the compression threads in
+   blocks, to be written as a gzip stream to output_fd. Return as soon as the
+   whole input has been read; deflate_end waits for the output. */
+struct deflate_file *deflate_begin (int input_fd, int output_fd,
+                                    long block_size, int processes,
+                                    int level, char *name, time_t mtime)
+{
+  long buffer_size, size_target, target;
+  size_t len, carry;
+  unsigned char const *data;
+  off_t start, pos, ahead;
+  uint64_t wait;
+  struct engine *e;
+  struct deflate_file *file;
+  job_t *prev_job, *job;
+  input_map_t *map;
+  int node, adapt, mapped;
+
+  adapt = block_size == ADAPTIVE_BLOCK && !rsync;
+  if (block_size < 0)
+    block_size = 0;
+  e = get_engine (processes, level, block_size);
+  processes = e->processes;
+  scheduler_clear_changes (e->scheduler);
+  if (rsync)
+    size_target = buffer_size = RSYNC_MAX < e->max_block
+                                ? RSYNC_MAX : e->max_block;
+  else
+    buffer_size = choose_block_size (ifile_size, processes, block_size,
+                                     e->max_block, &size_target);
+  file = Malloc (sizeof *file);
+
+  // Regular files are mapped rather than read, if they can be.
+  map = NULL;
+  start = pos = ahead = 0;
+  if (ifile_size > 0)
+    {
+      start = pos = ahead = lseek (input_fd, 0, SEEK_CUR);
+#ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise (input_fd, start, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      map = new_input_map (input_fd, start, ifile_size);
+    }
+  buffer_size = size_pools (e, buffer_size, map == NULL);
+  if (size_target > buffer_size)
+    size_target = buffer_size;
+  target = size_target;
+  e->busy++;
+  file->map = map;
+  file->jobs = 0;
+  file->read_ns = 0;
+  file->w_opts = new_write_options (output_fd, name, mtime, level,
+                                    write_batch);
+  prev_job = job = NULL;
+  carry = 0;
+  mapped = map != NULL;
 
   // Populate jobs add to job queue
   while(1)
     {
-      job = new_job (seq, input_pool, output_pool);
+      // take the spaces from the node of the thread the job will be dealt
+      // to, which is one further on if prev_job is still to be scheduled
+      node = scheduler_node (e->scheduler, prev_job != NULL);
+      job = new_job (e->seq, file->w_opts,
+                     mapped ? NULL : e->input_pools[node],
+                     e->output_pools[node]);
+      if (adapt)
+        target = adapt_block_size (e->scheduler, processes, target,
+                                   ifile_size < 0 ? buffer_size : size_target);
+
+      if (ifile_size > 0 && pos + READ_AHEAD * processes * target > ahead)
+        {
+          read_ahead (input_fd, ahead,
+                      pos + READ_AHEAD * processes * target);
+          ahead = pos + READ_AHEAD * processes * target;
+        }
 
-      if (load_job (job, input_fd)  == 0)
+      wait = now_ns ();
+      if (mapped && rsync)
+        {
+          // look ahead a whole buffer for the cut, then hand out to it
+          len = target;
+          data = map_peek (map, &len);
+          len = data == NULL ? (size_t) -1
+                : map_job (map, job, rsync_cut (data, len));
+        }
+      else if (mapped)
+        len = map_job (map, job, target);
+      else
+        {
+          // start with what the last job read beyond its cut
+          if (carry != 0)
+            carry_job (prev_job, job, carry);
+          len = load_job (job, input_fd, target);
+          if (rsync && len != (size_t) -1)
+            {
+              carry = cut_job (job);
+              len -= carry;
+            }
+        }
+      if (len == (size_t) -1)
+        read_error ();
+      file->read_ns += now_ns () - wait;
+      pos += len;
+
+      if (len == 0 && mapped)
+        {
+          // The map ends where the file did when it was opened, or where it
+          // was found to end if it has shrunk since. Read what was appended
+          // after that, if anything, as any other input is read.
+          finished_processing (job);
+          free_job (job);
+          lseek (input_fd, input_map_pos (map), SEEK_SET);
+          mapped = 0;
+          buffer_size = size_pools (e, buffer_size, 1);
+          if (target > buffer_size)
+            target = buffer_size;
+          continue;
+        }
+      if (len == 0 && prev_job != NULL)
 	{
-    	  if (prev_job != NULL)
-    	    {
-    	      set_last_job (prev_job);
-    	      add_job_end (job_queue, prev_job);
-    	    }
-    	  free_job (job);
-    	  break;
+	  set_last_job (prev_job);
+	  schedule_job (e->scheduler, prev_job);
+	  finished_processing (job);
+	  free_job (job);
+	  break;
 	}
+      if (len == 0)
+        {
+          // empty input: compress an empty block to end the deflate stream
+          set_last_job (job);
+          schedule_job (e->scheduler, job);
+          ++e->seq;
+          ++file->jobs;
+          break;
+        }
 
-      else if (prev_job != NULL)
+      if (prev_job != NULL)
     	{
-	  if (!independent)
-	    set_dictionary (prev_job, job, dict_pool);
-	  add_job_end (job_queue, prev_job);
+	  if (!independent && !rsync)
+	    set_dictionary (prev_job, job);
+	  schedule_job (e->scheduler, prev_job);
     	}
 
       prev_job = job;
-      ++seq;
+      ++e->seq;
+      ++file->jobs;
     }
-  close_job_queue (job_queue);
+  return file;
+}
 
+/* Return nonzero if all of file's output has been written. */
+int deflate_done (struct deflate_file *file)
+{
+  return write_done (file->w_opts);
+}
+
+/* Print how many of the spaces of pools, one per node, have been made, and
+   the most that have been in use at once, since the engine made them. */
+static void print_pool_stats (char const *what, pool_t **pools)
+{
+  int n, made, high, limit;
 
-  for (i = 0; i < processes + 1; ++i)
+  for (n = 0; n < engine->nodes; ++n)
     {
-      pthread_join (pthread_array[i], NULL);
+      if (pools[n] == NULL)
+        return;
+      pool_stats (pools[n], &made, &high, &limit);
+      fprintf (stderr, "  %s pool", what);
+      if (engine->nodes > 1)
+        fprintf (stderr, " on node %d", numa_node_id (engine->numa, n));
+      fprintf (stderr, ": %d of %d spaces made, at most %d in use\n",
+               made, limit, high);
     }
+}
+
+/* Print how many blocks were deflated at each level used. */
+static void print_levels (unsigned long levels[10])
+{
+  int i;
+
+  fprintf (stderr, "  levels:");
+  for (i = 0; i < 10; ++i)
+    if (levels[i] != 0)
+      fprintf (stderr, " %lu at %d", levels[i], i);
+  fprintf (stderr, "\n");
+}
+
+/* Print the most memory the engine's buffers and arenas have held, and how
+   the engine was fitted to the memory limit, if there is one. */
+static void print_memory (void)
+{
+  size_t used, peak;
+
+  memory_usage (&used, &peak);
+  fprintf (stderr, "  memory: %.1f MiB at peak", peak / 1048576.0);
+  if (memory_limit != 0)
+    fprintf (stderr, " of %.1f MiB allowed, %d threads with %d jobs each,"
+             " blocks up to %ld KiB", memory_limit / 1048576.0,
+             engine->processes, engine->depth, engine->max_block >> 10);
+  fprintf (stderr, "\n");
+}
+
+/* If the process runs under a CPU quota, print it, and how often and for
+   how long the quota throttled the process since the last report. */
+static void print_throttling (void)
+{
+  unsigned long long periods, throttled;
+  uint64_t ns;
+
+  if (cpu_throttling (&periods, &throttled, &ns) != 0)
+    return;
+  fprintf (stderr, "  cpu: %d threads, quota %.2f CPUs, throttled in %llu"
+           " of %llu periods for %.3f ms\n", engine->processes, cpu_quota (),
+           throttled - engine->throttled, periods - engine->periods,
+           (ns - engine->throttled_ns) / 1e6);
+  engine->periods = periods;
+  engine->throttled = throttled;
+  engine->throttled_ns = ns;
+}
+
+/* What deflate_end found out about the last file it ended, kept for
+   deflate_report to print once gzip has ended that file's line. */
+static struct
+{
+  int pending;                  /* a file has ended and not been reported */
+  unsigned long blocks[BLOCK_KINDS];
+  unsigned long levels[10];
+  unsigned long raises, drops;  /* level changes */
+  unsigned long jobs, writes;
+  uint64_t read_ns;
+} report;
+
+/* Print the statistics of the last file deflate_end ended, one per line, if
+   they have not been printed yet: the levels it was deflated at, if they
+   were tuned, and the engine's memory and CPU throttling with -v, and with
+   -vv also how its blocks were deflated and how the threads, the reader,
+   the writer and the pools went about it. */
+void deflate_report (void)
+{
+  if (!report.pending)
+    return;
+  report.pending = 0;
+  if (target_rate != 0 || io_boost)
+    print_levels (report.levels);
+  print_memory ();
+  print_throttling ();
+  if (verbose > 1)
+    {
+      fprintf (stderr, "  blocks: %lu default, %lu filtered, %lu huffman,"
+               " %lu rle, %lu stored\n", report.blocks[Z_DEFAULT_STRATEGY],
+               report.blocks[Z_FILTERED], report.blocks[Z_HUFFMAN_ONLY],
+               report.blocks[Z_RLE],
+               report.blocks[BLOCK_INDEX (STORED_BLOCK)]);
+      if (target_rate != 0 || io_boost)
+        fprintf (stderr, "  level changes: %lu up, %lu down\n",
+                 report.raises, report.drops);
+      print_scheduler_stats (engine->scheduler, stderr);
+      fprintf (stderr, "  reader: %.3f ms waiting for input\n",
+               report.read_ns / 1e6);
+      fprintf (stderr, "  writer: %lu jobs in %lu writes\n", report.jobs,
+               report.writes);
+      print_pool_stats ("input", engine->input_pools);
+      print_pool_stats ("output", engine->output_pools);
+    }
+}
+
+/* Wait until all of file's output has been written, and free file. Report a
+   write error, which exits. With -v, keep the file's statistics for
+   deflate_report. */
+void deflate_end (struct deflate_file *file)
+{
+  unsigned long writes;
+  int write_errno, shrunk = 0;
+
+  write_errno = write_status (file->w_opts, &writes);
+  if (verbose)
+    {
+      report.pending = 1;
+      write_blocks (file->w_opts, report.blocks);
+      write_levels (file->w_opts, report.levels);
+      scheduler_changes (engine->scheduler, &report.raises, &report.drops);
+      report.jobs = file->jobs;
+      report.writes = writes;
+      report.read_ns = file->read_ns;
+    }
+  engine->busy--;
+  if (file->map != NULL)
+    {
+      shrunk = input_map_shrunk (file->map);
+      free_input_map (file->map);
+    }
+  free_write_options (file->w_opts);
+  free (file);
+  if (write_errno != 0)
+    {
+      errno = write_errno;
+      write_error ();
+    }
+  if (shrunk)
+    {
+      // part of the input went missing while it was being compressed
+      errno = 0;
+      read_error ();
+    }
+}
 
-  free_pool (input_pool);
-  free_pool (output_pool);
-  if (!independent)
-    free_pool (dict_pool);
-  free_job_queue (job_queue);
-  free_job_queue (write_job_queue);
-  free_compress_options (c_opts);
-  free_write_options (w_opts);
-  free (pthread_array);
+int deflate_file_parallel (int input_fd, int output_fd, long block_size,
+			   int processes, int level, char *name, time_t mtime)
+{
+  deflate_end (deflate_begin (input_fd, output_fd, block_size, processes,
+                              level, name, mtime));
   return 0;
 }
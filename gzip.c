@@ -86,7 +86,6 @@ static char const *const license_msg[] = {
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/sysinfo.h>
 
 #define INBUFS(p) (((p)<<1)+3)
 
@@ -199,6 +198,14 @@ static char *env;            /* contents of GZIP env variable */
 static char const *z_suffix; /* default suffix (can be set with --suffix) */
 static size_t z_len;         /* strlen(z_suffix) */
        int processes; 
+       long block_size = 0;  /* compression block size, 0 for automatic */
+       long write_batch = WRITE_BATCH; /* output bytes per write */
+       int huge_pages = 0;    /* back compression buffers with huge pages */
+       int numa_aware = 0;    /* place threads and buffers on NUMA nodes */
+       long memory_limit = 0; /* bytes of compression buffers, 0 for none */
+       int strategy = 0;      /* zlib strategy, or -1 to choose per block */
+       double target_rate = 0; /* bytes per second to compress at, or 0 */
+       int io_boost = 0;      /* raise the level while output holds us up */
        int temp_fd;
 
 /* The original timestamp (modification time).  If the original is
@@ -233,6 +240,27 @@ static struct stat istat;         /* status for input file */
 int  ifd;                  /* input file descriptor */
 int  ofd;                  /* output file descriptor */
 static int dfd = -1;       /* output directory file descriptor */
+
+/* Files being compressed whose output is still being written, oldest first.
+   treat_file moves on to the next file as soon as the compression threads
+   have all of a file's input, so that many small files keep all the threads
+   busy; the rest of the work on a file (closing it, copying its status,
+   removing the input) is done once its output has been written.  The number
+   of such files is bounded by the descriptors they hold and by the bytes of
+   input they may keep mapped.  */
+struct pending_file
+{
+  struct deflate_file *deflate;
+  int ifd, ofd;
+  char *ifname, *ofname;
+  struct stat istat;
+};
+#define MAX_PENDING 64
+#define MAX_PENDING_BYTES ((off_t) 256 << 20)
+static struct pending_file pending[MAX_PENDING];
+static int pending_count;
+static int max_pending;
+static off_t pending_bytes;
 unsigned insize;           /* valid bytes in inbuf */
 unsigned inptr;            /* index of next byte to be processed in inbuf */
 unsigned outcnt;           /* bytes in output buffer */
@@ -265,6 +293,14 @@ static int handled_sig[] =
 enum
 {
   PRESUME_INPUT_TTY_OPTION = CHAR_MAX + 1,
+  BLOCK_SIZE_OPTION,
+  WRITE_BATCH_OPTION,
+  HUGE_PAGES_OPTION,
+  NUMA_OPTION,
+  MEMORY_LIMIT_OPTION,
+  STRATEGY_OPTION,
+  TARGET_RATE_OPTION,
+  IO_BOOST_OPTION,
   RSYNCABLE_OPTION,
   SYNCHRONOUS_OPTION,
 
@@ -308,6 +344,14 @@ static const struct option longopts[] =
     {"bits",       1, 0, 'b'}, /* max number of bits per code (implies -Z) */
     {"rsyncable",  0, 0, RSYNCABLE_OPTION}, /* make rsync-friendly archive */
     {"processes",  1, 0, 'p'},
+    {"block-size", 1, 0, BLOCK_SIZE_OPTION}, /* compression block size */
+    {"write-batch", 1, 0, WRITE_BATCH_OPTION}, /* output bytes per write */
+    {"huge-pages", 0, 0, HUGE_PAGES_OPTION}, /* huge page buffers */
+    {"numa",       0, 0, NUMA_OPTION}, /* NUMA-local threads and buffers */
+    {"memory-limit", 1, 0, MEMORY_LIMIT_OPTION}, /* compression memory */
+    {"strategy",   1, 0, STRATEGY_OPTION}, /* deflate strategy */
+    {"target-rate", 1, 0, TARGET_RATE_OPTION}, /* adapt level to MB/s */
+    {"io-boost",   0, 0, IO_BOOST_OPTION}, /* adapt level to the output */
     { 0, 0, 0, 0 }
 };
 
@@ -320,6 +364,10 @@ local void version      (void);
 local int input_eof	(void);
 local void treat_stdin  (void);
 local void treat_file   (char *iname);
+local void finish_file  (void);
+local void defer_file   (void);
+local void finish_pending (int all);
+local void remove_pending_outputs (void);
 local int create_outfile (void);
 local char *get_suffix  (char *name);
 local int  open_input_file (char *iname, struct stat *sbuf);
@@ -392,6 +440,21 @@ local void help()
  "  -1, --fast        compress faster",
  "  -9, --best        compress better",
  "  -p, --processes=n allow up to n compression threads",
+ "      --block-size=SIZE  compress in blocks of SIZE bytes, or 'auto',",
+ "                    or 'adaptive' to size them to the measured speed",
+ "                    (the output then varies from run to run)",
+ "      --write-batch=SIZE  gather up to SIZE bytes of output per write",
+ "      --huge-pages  back compression buffers with transparent huge pages",
+ "      --numa        spread compression threads over NUMA nodes, with",
+ "                    buffers local to each node",
+ "      --memory-limit=SIZE  fit compression threads and buffers in SIZE",
+ "                    bytes, running fewer threads if need be",
+ "      --strategy=S  deflate with strategy S: default, filtered, huffman,",
+ "                    rle, or auto to choose one for each block",
+ "      --target-rate=MB/s  raise or lower the level block by block to",
+ "                    compress about MB/s megabytes (10^6) a second",
+ "      --io-boost    raise the level block by block while writing the",
+ "                    output is slower than compressing it",
 #ifdef LZW
  "  -Z, --lzw         produce output compatible with old compress",
  "  -b, --bits=BITS   max number of bits per code (implies -Z)",
@@ -424,6 +487,64 @@ local void version()
     printf ("Written by Jean-loup Gailly.\n");
 }
 
+/* Parse the operand ARG of option OPTION as a byte count with an optional
+   K, M or G suffix, and return it.  Diagnose an invalid operand.  */
+local long parse_size (char const *arg, char const *option)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol (arg, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': n = n <= LONG_MAX >> 10 ? n << 10 : -1; end++; break;
+    case 'm': case 'M': n = n <= LONG_MAX >> 20 ? n << 20 : -1; end++; break;
+    case 'g': case 'G': n = n <= LONG_MAX >> 30 ? n << 30 : -1; end++; break;
+    }
+    if (errno || end == arg || *end || n < 0) {
+        fprintf (stderr, "%s: %s operand is not a valid size\n",
+                 program_name, option);
+        try_help ();
+    }
+    return n;
+}
+
+/* Parse the operand ARG of --strategy and return zlib's number for the
+   strategy it names, or -1 for auto.  Diagnose an invalid operand.  */
+local int parse_strategy (char const *arg)
+{
+    static char const *const names[] = {
+        "default", "filtered", "huffman", "rle", NULL
+    };
+    int i;
+
+    if (strequ (arg, "auto"))
+        return -1;
+    for (i = 0; names[i] != NULL; i++)
+        if (strequ (arg, names[i]))
+            return i;
+    fprintf (stderr, "%s: --strategy operand must be default, filtered,"
+             " huffman, rle or auto\n", program_name);
+    try_help ();
+}
+
+/* Parse the operand ARG of --target-rate, in megabytes a second, and return
+   it in bytes a second.  Diagnose an invalid operand.  */
+local double parse_rate (char const *arg)
+{
+    char *end;
+    double rate;
+
+    errno = 0;
+    rate = strtod (arg, &end);
+    if (errno || end == arg || *end || !(0 < rate && rate < 1e9)) {
+        fprintf (stderr, "%s: --target-rate operand is not a valid rate\n",
+                 program_name);
+        try_help ();
+    }
+    return rate * 1e6;
+}
+
 local void progerror (char const *string)
 {
     int e = errno;
@@ -442,7 +563,7 @@ int main (int argc, char **argv)
     int env_argc;
     char **env_argv;
 
-    processes = get_nprocs();
+    processes = default_processes ();
     EXPAND(argc, argv); /* wild card expansion if necessary */
 
     program_name = gzip_base_name (argv[0]);
@@ -574,6 +695,42 @@ int main (int argc, char **argv)
             if (INBUFS(processes) < 1)
                 exit(EXIT_FAILURE);
             break;
+        case BLOCK_SIZE_OPTION:
+            if (strequ (optarg, "auto"))
+              block_size = 0;
+            else if (strequ (optarg, "adaptive"))
+              block_size = ADAPTIVE_BLOCK;
+            else {
+              block_size = parse_size (optarg, "--block-size");
+              if (block_size < MIN_BLOCK_SIZE || MAX_BLOCK_SIZE < block_size) {
+                fprintf (stderr, "%s: --block-size must be between %dK and"
+                         " %dM\n", program_name, MIN_BLOCK_SIZE >> 10,
+                         MAX_BLOCK_SIZE >> 20);
+                try_help ();
+              }
+            }
+            break;
+        case WRITE_BATCH_OPTION:
+            write_batch = parse_size (optarg, "--write-batch");
+            break;
+        case HUGE_PAGES_OPTION:
+            huge_pages = 1;
+            break;
+        case NUMA_OPTION:
+            numa_aware = 1;
+            break;
+        case MEMORY_LIMIT_OPTION:
+            memory_limit = parse_size (optarg, "--memory-limit");
+            break;
+        case STRATEGY_OPTION:
+            strategy = parse_strategy (optarg);
+            break;
+        case TARGET_RATE_OPTION:
+            target_rate = parse_rate (optarg);
+            break;
+        case IO_BOOST_OPTION:
+            io_boost = 1;
+            break;
         case 'q':
         case 'q' + ENV_OPTION:
             quiet = 1; verbose = 0; break;
@@ -666,6 +823,19 @@ int main (int argc, char **argv)
 
     if (do_lzw && !decompress) work = lzw;
 
+    if (memory_limit != 0 && memory_limit < deflate_min_memory (block_size)) {
+        fprintf (stderr, "%s: --memory-limit must be at least %ldK with"
+                 " these options\n", program_name,
+                 (deflate_min_memory (block_size) + 1023) >> 10);
+        try_help ();
+    }
+
+    if (io_boost && target_rate != 0) {
+        fprintf (stderr, "%s: --io-boost and --target-rate cannot be used"
+                 " together\n", program_name);
+        try_help ();
+    }
+
     /* Allocate all global buffers (for DYN_ALLOC option) */
     ALLOC(uch, inbuf,  INBUFSIZ +INBUF_EXTRA);
     ALLOC(uch, outbuf, OUTBUFSIZ+OUTBUF_EXTRA);
@@ -692,6 +862,7 @@ int main (int argc, char **argv)
     } else {  /* Standard input */
         treat_stdin();
     }
+    finish_pending (1);
     if (stdin_was_read && close (STDIN_FILENO) != 0)
       {
         strcpy (ifname, "stdin");
@@ -835,6 +1006,7 @@ local void treat_stdin()
         } else if (!decompress) {
             display_ratio(bytes_in-(bytes_out-header_bytes), bytes_in, stderr);
             fprintf(stderr, "\n");
+            deflate_report ();
 #ifdef DISPLAY_STDIN_RATIO
         } else {
             display_ratio(bytes_out-(bytes_in-header_bytes), bytes_out,stderr);
@@ -892,6 +1064,8 @@ atdir_set (char const *dir, ptrdiff_t dirlen)
 local void treat_file(iname)
     char *iname;
 {
+    finish_pending (0);
+
     /* Accept "-" as synonym for stdin */
     if (strequ(iname, "-")) {
         int cflag = to_stdout;
@@ -1022,6 +1196,11 @@ local void treat_file(iname)
         fprintf(stderr, "%s:\t", ifname);
     }
 
+    /* Compressing a regular file to a regular file, leave the output to
+     * be finished later and go on to the next file.  */
+    zip_defer = (work == zip && !to_stdout && !verbose && !synchronous
+                 && S_ISREG (istat.st_mode));
+
     /* Actually do the compression/decompression. Loop over zipped members.
      */
     for (;;) {
@@ -1037,7 +1216,22 @@ local void treat_file(iname)
         if (method < 0) break;    /* error message already emitted */
         bytes_out = 0;            /* required for length check */
     }
+    zip_defer = 0;
+
+    if (zip_pending != NULL) {
+        defer_file ();
+        return;
+    }
+    finish_file ();
+}
 
+/* ========================================================================
+ * Close the input and output files of the file just compressed or
+ * decompressed, copy the input's status to the output, remove the input
+ * and display statistics, as the options require.
+ */
+local void finish_file()
+{
     if (close (ifd) != 0)
       read_error ();
 
@@ -1096,7 +1290,104 @@ local void treat_file(iname)
           fprintf(stderr, " -- %s %s", keep ? "created" : "replaced with",
                   ofname);
         fprintf(stderr, "\n");
+        /* the compressor's own statistics go on lines of their own */
+        deflate_report ();
+    }
+}
+
+/* ========================================================================
+ * Put the file zip just started on the list of pending files, taking it
+ * over from the globals describing the current file, and wait for older
+ * files while there are too many or too large ones in flight.
+ */
+local void defer_file()
+{
+    struct pending_file *p;
+    sigset_t oldset;
+
+    if (max_pending == 0) {
+        /* each pending file holds two descriptors; leave some spare */
+        max_pending = (getdtablesize () - 16) / 2;
+        if (max_pending > MAX_PENDING) max_pending = MAX_PENDING;
+        if (max_pending < 1) max_pending = 1;
+    }
+
+    sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+    p = &pending[pending_count++];
+    p->deflate = zip_pending;
+    p->ifd = ifd;
+    p->ofd = ofd;
+    p->ifname = xstrdup (ifname);
+    p->ofname = xstrdup (ofname);
+    p->istat = istat;
+    pending_bytes += istat.st_size;
+    zip_pending = NULL;
+    remove_ofname_fd = -1;
+    sigprocmask (SIG_SETMASK, &oldset, NULL);
+
+    while (pending_count >= max_pending
+           || (pending_count > 1 && pending_bytes > MAX_PENDING_BYTES)) {
+        int n = pending_count;
+        finish_pending (0);
+        if (pending_count == n) {
+            /* nothing was done yet: wait for the oldest file */
+            finish_pending (-1);
+        }
+    }
+}
+
+/* ========================================================================
+ * Finish pending files, oldest first: those whose output has been
+ * written if all is 0, the oldest one whatever its state if all is -1,
+ * and all of them otherwise.  The globals describing the current file
+ * are overwritten.
+ */
+local void finish_pending(all)
+    int all;
+{
+    struct pending_file p;
+    sigset_t oldset;
+    int i;
+
+    while (pending_count > 0
+           && (all != 0 || deflate_done (pending[0].deflate))) {
+        sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+        p = pending[0];
+        for (i = 1; i < pending_count; i++)
+            pending[i - 1] = pending[i];
+        pending_count--;
+        pending_bytes -= p.istat.st_size;
+        ifd = p.ifd;
+        ofd = remove_ofname_fd = p.ofd;
+        strcpy (ifname, p.ifname);
+        strcpy (ofname, p.ofname);
+        istat = p.istat;
+        sigprocmask (SIG_SETMASK, &oldset, NULL);
+        free (p.ifname);
+        free (p.ofname);
+
+        deflate_end (p.deflate);
+        method = DEFLATED;
+        finish_file ();
+        if (all < 0)
+            break;
+    }
+}
+
+/* ========================================================================
+ * Close and unlink the outputs of all pending files.
+ */
+local void remove_pending_outputs()
+{
+    sigset_t oldset;
+
+    sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+    while (pending_count > 0) {
+        pending_count--;
+        close (pending[pending_count].ofd);
+        xunlink (pending[pending_count].ofname);
     }
+    sigprocmask (SIG_SETMASK, &oldset, NULL);
 }
 
 /* ========================================================================
@@ -2023,6 +2314,24 @@ local void copy_stat(ifstat)
 /* ========================================================================
  * Recurse through the given directory.
  */
+/* A directory entry, and the size of the file it names.  */
+struct dir_entry
+{
+    char const *name;
+    off_t size;
+};
+
+/* Order directory entries largest first, keeping the directory's order
+   among entries of the same size.  */
+local int larger_first (a, b)
+    void const *a, *b;
+{
+    struct dir_entry const *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return x->name < y->name ? -1 : x->name > y->name;
+}
+
 local void treat_dir (fd, dir)
     int fd;
     char *dir;
@@ -2032,6 +2341,9 @@ local void treat_dir (fd, dir)
     char *entries;
     char const *entry;
     size_t entrylen;
+    struct dir_entry *list;
+    size_t count, i;
+    struct stat st;
 
     dirp = fdopendir (fd);
 
@@ -2049,8 +2361,40 @@ local void treat_dir (fd, dir)
     if (! entries)
       return;
 
+    count = 0;
+    for (entry = entries; *entry; entry += strlen (entry) + 1)
+        count++;
+    list = xnmalloc (count + 1, sizeof *list);
+    count = 0;
     for (entry = entries; *entry; entry += entrylen + 1) {
+        entrylen = strlen (entry);
+        list[count].name = entry;
+        list[count++].size = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        size_t len = strlen (dir);
+        entry = list[i].name;
+        entrylen = strlen (entry);
+        if (strequ (entry, ".") || strequ (entry, ".."))
+          continue;
+        if (len + entrylen < MAX_PATH_LEN - 2) {
+            strcpy(nbuf,dir);
+            if (*last_component (nbuf) && !ISSLASH (nbuf[len - 1]))
+              nbuf[len++] = '/';
+            strcpy (nbuf + len, entry);
+            /* When compressing, start on the largest files so that the
+             * small ones fill in the threads around them at the end.  */
+            if (!decompress && lstat (nbuf, &st) == 0 && S_ISREG (st.st_mode))
+              list[i].size = st.st_size;
+        }
+    }
+    if (!decompress)
+      qsort (list, count, sizeof *list, larger_first);
+
+    for (i = 0; i < count; i++) {
         size_t len = strlen (dir);
+        entry = list[i].name;
         entrylen = strlen (entry);
         if (strequ (entry, ".") || strequ (entry, ".."))
           continue;
@@ -2066,6 +2410,7 @@ local void treat_dir (fd, dir)
             exit_code = ERROR;
         }
     }
+    free (list);
     free (entries);
 }
 #endif /* ! NO_DIR */
@@ -2122,6 +2467,7 @@ local void do_exit(exitcode)
 
     if (in_exit) exit(exitcode);
     in_exit = 1;
+    deflate_shutdown();
     free(env);
     env  = NULL;
     FREE(inbuf);
@@ -2172,6 +2518,7 @@ void
 abort_gzip ()
 {
    remove_output_file ();
+   remove_pending_outputs ();
    do_exit(ERROR);
 }
 
@@ -2185,6 +2532,7 @@ abort_gzip_signal (sig)
   if (! SA_NOCLDSTOP)
     signal (sig, SIG_IGN);
    remove_output_file ();
+   remove_pending_outputs ();
    if (sig == exiting_signal)
      _exit (WARNING);
    signal (sig, SIG_DFL);
@@ -203,6 +203,26 @@ extern int to_stdout;      /* output to stdout (-c) */
 extern int save_orig_name; /* set if original name must be saved */
 extern int independent;
 extern int processes;
+extern long block_size;    /* compression block size, 0 for automatic */
+#define ADAPTIVE_BLOCK (-1)  /* block_size: adapt to the measured rate */
+
+/* Bounds on --block-size.  A block must hold a whole deflate dictionary
+   and fit in a zlib stream's avail_in.  */
+#define MIN_BLOCK_SIZE 0x8000
+#define MAX_BLOCK_SIZE 0x40000000
+
+/* Regular files of at most this many bytes are compressed on the main
+   thread, as a single block.  */
+#define SMALL_FILE 0x10000
+
+extern long write_batch;   /* output bytes to gather per write */
+#define WRITE_BATCH 0x100000
+extern int huge_pages;     /* back compression buffers with huge pages */
+extern int numa_aware;     /* place threads and buffers on NUMA nodes */
+extern long memory_limit;  /* bytes of compression buffers, 0 for none */
+extern int strategy;       /* zlib strategy, or -1 to choose per block */
+extern double target_rate; /* bytes per second to compress at, or 0 */
+extern int io_boost;       /* raise the level while output holds us up */
 extern int temp_fd;
 
 #define get_byte()  (inptr < insize ? inbuf[inptr++] : fill_inbuf(0))
@@ -267,6 +287,8 @@ extern int temp_fd;
         /* in zip.c: */
 extern int zip        (int in, int out);
 extern int file_read  (char *buf,  unsigned size);
+extern int zip_defer;  /* leave the output for the caller to finish */
+extern struct deflate_file *zip_pending; /* the output zip left unfinished */
 
         /* in unzip.c */
 extern int unzip      (int in, int out);
@@ -284,6 +306,21 @@ extern noreturn void abort_gzip (void);
         /* in deflate.c */
 extern void lm_init (int pack_level, ush *flags);
 //extern off_t deflate (void);
+struct deflate_file;
+extern struct deflate_file *deflate_begin (int input_fd, int output_fd,
+                                           long block_size, int processes,
+                                           int level, char *name,
+                                           time_t mtime);
+extern int  deflate_done     (struct deflate_file *file);
+extern void deflate_end      (struct deflate_file *file);
+extern void deflate_report   (void);
+extern int  deflate_small    (int input_fd, int output_fd, int level,
+                              char *name, time_t mtime);
+extern void deflate_shutdown (void);
+extern long deflate_min_memory (long block_size);
+
+        /* in parallel.c */
+extern int default_processes (void);
 
         /* in trees.c */
 extern void ct_init     (ush *attr, int *method);
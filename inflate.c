@@ -24,6 +24,7 @@
 #include <assert.h>
 #include "inflate.h"
 #include "utils.h"
+#include "crc.h"
 
 #ifndef WINDOW_BITS
 #  define WINDOW_BITS 15
@@ -55,6 +56,47 @@ static void strm_init (z_stream *strm)
   ret = inflateInit2(strm, WINDOW_BITS | GZIP_ENCODING);
   if (ret != Z_OK)
     exit (EXIT_FAILURE);
+  // the trailer CRC and length are checked by inflate_file, the CRC with
+  // the shared kernel
+  inflateValidate (strm, 0);
+}
+
+/*
+keep_tail(tail, buf, len):
+remember the last 8 input bytes seen, so that a gzip trailer split across
+two reads can still be found once inflate reports the end of the member
+*/
+static void keep_tail (unsigned char *tail, unsigned char const *buf, size_t len)
+{
+  if (len >= 8)
+    memcpy (tail, buf + len - 8, 8);
+  else
+    {
+      memmove (tail, tail + len, 8 - len);
+      memcpy (tail + 8 - len, buf, len);
+    }
+}
+
+/*
+trailer_ok(tail, in, used, check, size):
+return nonzero if the trailer that ends after the first used bytes of in,
+taking its start from tail if the trailer began in the previous read, holds
+the CRC-32 check and the length size (modulo 2^32) of the member's output
+*/
+static int trailer_ok (unsigned char const *tail, unsigned char const *in,
+                       size_t used, uint32_t check, uint32_t size)
+{
+  unsigned char t[8];
+  if (used >= 8)
+    memcpy (t, in + used - 8, 8);
+  else
+    {
+      memcpy (t, tail + used, 8 - used);
+      memcpy (t + 8 - used, in, used);
+    }
+  return check == (t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t) t[3] << 24))
+         && size == (t[4] | (t[5] << 8) | (t[6] << 16)
+                     | ((uint32_t) t[7] << 24));
 }
 
 int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_bytes)
@@ -63,6 +105,10 @@ int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_b
   int flush;
   int read_count;
   int write_count;
+  int status = 0;
+  int ended = 0;
+  uint32_t check = 0, size = 0;
+  unsigned char tail[8] = { 0 };
   z_stream strm;
   strm_init (&strm);
   unsigned char *in = Calloc (BUFFER_SIZE_INFLATE, sizeof (char));
@@ -86,6 +132,15 @@ int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_b
           write_count = write (output_fd, out, BUFFER_SIZE_INFLATE - strm.avail_out);
           assert (write_count != -1);
           *write_bytes += write_count;
+          check = crc32_update (check, out, write_count);
+          size += write_count;
+          if (ret == Z_STREAM_END && !ended)
+            {
+              if (!trailer_ok (tail, in, strm.next_in - in, check, size))
+                status = -1;
+              check = size = 0;
+              ended = 1;
+            }
           if (ret == Z_STREAM_END && strm.avail_in != 0)
             {
               //If meet the end of stream, initialize the new stream
@@ -93,6 +148,7 @@ int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_b
               unsigned char *temp_in = strm.next_in;
               int temp_avail_in = strm.avail_in;
               strm_init (&strm);
+              ended = 0;
               strm.next_in = temp_in;
               strm.avail_in = temp_avail_in;
               strm.avail_out = 0; 
@@ -100,11 +156,13 @@ int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_b
             }
         }
       while (strm.avail_out == 0);
+      // before the next read overwrites in
+      keep_tail (tail, in, read_count);
     }
   while (read_count > 0);
 
   inflateEnd (&strm);
   free (in);
   free (out);
-  return 0;
+  return status;
 }
@@ -16,4 +16,5 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
 
+/* Returns 0, or -1 if a member's CRC-32 does not match its trailer. */
 int inflate_file (int input_fd, int output_fd, off_t *read_bytes, off_t *write_bytes);
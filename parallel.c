@@ -1,19 +1,41 @@
-#include <stdio.h>
 #include <config.h>
+#include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <assert.h>
 #include <zlib.h>
 #include "parallel.h"
+#include "crc.h"
 #include "utils.h"
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 // Sliding dictionary size for deflate.
 #define DICT 32768U
 
+// Input is handed to deflate this many bytes at a time, each stride's CRC
+// computed just before deflate reads it, so the block goes through the
+// cache once instead of twice.  Small enough to stay in L1/L2 between
+// the two passes.
+#define CRC_STRIDE 32768U
+
+// Alignment that keeps data written by different threads apart.
+#define CACHE_LINE 64
+
 
 struct condition_t
 {
@@ -126,6 +148,50 @@ void increment_lock(lock_t* lock)
 // specified limit on the number of spaces has been reached. Only if the limit
 // is reached will it wait for a space to be returned to the pool. Each space
 // knows what pool it belongs to, so that it can be returned.
+//
+// Spaces are made on first demand rather than with the pool, and their
+// buffers are not cleared, so a small file only ever touches the few
+// buffers it needs. A pool may instead carve its buffers out of chunks
+// backed by transparent huge pages, to spare the TLB on large inputs, and
+// may keep its buffers on one NUMA node (see below).
+//
+// The free list is a lock-free stack, so getting and returning a space takes
+// no lock unless the pool is exhausted, when the getter sleeps on the have
+// semaphore. Spaces are named by their index in the pool, and the stack head
+// packs the index of the top space with a tag that changes on every update,
+// so that a head that was popped and pushed back between a thread's load and
+// its compare-and-swap is not mistaken for an unchanged one. The stack is
+// last in, first out: the space handed out next is the one returned most
+// recently, still warm in the cache of the core that used it.
+
+// Size and alignment of a huge page chunk.
+#define HUGE_PAGE 0x200000U
+
+// Bytes held by pool buffers and zlib arenas, now and at most so far, so that
+// a memory limit can be checked against what was really used.
+static atomic_size_t memory_used;
+static atomic_size_t memory_peak;
+
+static void count_memory (size_t len)
+{
+  size_t used = atomic_fetch_add (&memory_used, len) + len;
+  size_t peak = atomic_load (&memory_peak);
+  while (used > peak
+         && !atomic_compare_exchange_weak (&memory_peak, &peak, used))
+    ;
+}
+
+static void uncount_memory (size_t len)
+{
+  atomic_fetch_sub (&memory_used, len);
+}
+
+// Report the bytes of buffers and arenas in use now, and the most ever.
+void memory_usage (size_t *used, size_t *peak)
+{
+  *used = atomic_load (&memory_used);
+  *peak = atomic_load (&memory_peak);
+}
 
 // A space (one buffer for each space).
 struct space_t
@@ -133,8 +199,12 @@ struct space_t
   unsigned char *buf;     // buffer of size size
   size_t size;            // current size of this buffer
   size_t len;             // for application usage (initially zero)
+  atomic_int use;         // number of jobs using this space
   pool_t *pool;      // pool to return to
-  space_t *next;     // for pool linked list
+  unsigned index;    // position in the pool's spaces
+  atomic_uint next;  // index + 1 of the space below on the free list, or 0
+  job_t *job;        // job kept for reuse by the next job given this space
+  map_window_t *window; // mapping buf points into, instead of a pool
 };
 
 
@@ -142,11 +212,15 @@ space_t *new_space(int size)
 {
   space_t *space;
   space = Malloc(sizeof(space_t));
-  space->buf = Calloc(size, sizeof(unsigned char));
+  space->buf = Malloc(size);
   space->size = size;
   space->len = 0;
+  atomic_init(&space->use, 0);
   space->pool = NULL;
-  space->next = NULL;
+  space->index = 0;
+  atomic_init(&space->next, 0);
+  space->job = NULL;
+  space->window = NULL;
   return space;
 }
 
@@ -156,75 +230,234 @@ space_t *new_space(int size)
 // nobody needs this space anymore.
 void free_space(space_t *space)
 {
+  free(space->job);
   free(space->buf);
   free(space);
 }
 
 
+// Memory that huge page spaces are carved from.
+struct chunk
+{
+  struct chunk *next;
+  void *mem;
+  size_t len;
+};
+
 // Pool of spaces (one pool for each type needed).
 struct pool_t
 {
   lock_t *have;     // unused spaces available, for list
-  lock_t *safe;     //ensures safe use of pool in multithreaded environment
-  space_t *head;    // linked list of available buffers
+  lock_t *safe;     // serialises making new spaces
+  _Atomic uint64_t head; // tag << 32 | index + 1 of the top free space
+  space_t **spaces; // the spaces made so far, by index
   size_t size;      // size of new buffers in this pool
   int limit;        // number of new spaces allowed
+  atomic_int made;  // spaces made so far
+  atomic_int used;  // spaces handed out and not yet returned
+  atomic_int high;  // most spaces ever handed out at once
+  int huge;         // carve buffers from huge page chunks
+  int node;         // NUMA node to keep buffers on, or -1 for any
+  struct chunk *chunks; // chunks carved so far, newest first
+  size_t left;      // bytes not yet carved from the newest chunk
 };
 
-pool_t *new_pool(size_t size, int limit) {
+// Return the most memory a pool of limit spaces of size bytes can come to
+// hold, once it has made all of its spaces.
+size_t pool_memory (size_t size, int limit, int huge)
+{
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    {
+      size_t need = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+      size_t chunk = (need + HUGE_PAGE - 1) & ~(size_t) (HUGE_PAGE - 1);
+      size_t per_chunk = chunk / need;
+      return (limit + per_chunk - 1) / per_chunk * chunk;
+    }
+#endif
+  return (size_t) limit * size;
+}
+
+pool_t *new_pool(size_t size, int limit, int huge, int node) {
   pool_t *pool;
   pool = Malloc(sizeof(pool_t));
   pool->have = new_lock(limit, 1);
   pool->safe = new_lock(1, 1);
-  pool->head = NULL;
+  atomic_init(&pool->head, 0);
+  pool->spaces = Calloc(limit, sizeof(space_t *));
   pool->size = size;
   pool->limit = limit;
+  atomic_init(&pool->made, 0);
+  atomic_init(&pool->used, 0);
+  atomic_init(&pool->high, 0);
+#ifdef MADV_HUGEPAGE
+  pool->huge = huge;
+#else
+  pool->huge = 0;
+#endif
+  pool->node = node;
+  pool->chunks = NULL;
+  pool->left = 0;
+  return pool;
+}
 
-  if (size <= 0)
-    return pool;
+static void bind_node (void *addr, size_t len, int node);
 
-  int i;
-  space_t *cur;
-  pool->head = new_space(pool->size);
-  i = 0;
-  cur = pool->head;
-  while(i < limit-1)
-    {
-      cur->pool = pool;
-      cur->next = new_space(pool->size);
-      cur = cur->next;
-      ++i;
-    }
-  cur->pool = pool;
-  cur->next = NULL;
-  return pool;
+// Make a space for pool. With huge pages its buffer is carved from the
+// newest chunk, a new chunk being started when that one is used up. A pool
+// on a node gets page aligned memory, bound to the node before it is first
+// touched.
+static space_t *pool_space (pool_t *pool)
+{
+  space_t *space = Malloc (sizeof (space_t));
+
+  get_lock (pool->safe);
+#ifdef MADV_HUGEPAGE
+  if (pool->huge)
+    {
+      struct chunk *chunk;
+      size_t need = (pool->size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+
+      if (pool->left < need)
+        {
+          chunk = Malloc (sizeof *chunk);
+          chunk->len = (need + HUGE_PAGE - 1) & ~(size_t) (HUGE_PAGE - 1);
+          chunk->mem = Memalign (HUGE_PAGE, chunk->len);
+          madvise (chunk->mem, chunk->len, MADV_HUGEPAGE);
+          count_memory (chunk->len);
+          if (pool->node >= 0)
+            bind_node (chunk->mem, chunk->len, pool->node);
+          chunk->next = pool->chunks;
+          pool->chunks = chunk;
+          pool->left = chunk->len;
+        }
+      space->buf = (unsigned char *) pool->chunks->mem
+                   + (pool->chunks->len - pool->left);
+      pool->left -= need;
+    }
+  else
+#endif
+  if (pool->node >= 0)
+    {
+      space->buf = Memalign (sysconf (_SC_PAGESIZE), pool->size);
+      bind_node (space->buf, pool->size, pool->node);
+    }
+  else
+    space->buf = Malloc (pool->size);
+  if (!pool->huge)
+    count_memory (pool->size);
+  release_lock (pool->safe);
+  space->size = pool->size;
+  space->len = 0;
+  atomic_init (&space->use, 0);
+  atomic_init (&space->next, 0);
+  space->job = NULL;
+  space->window = NULL;
+  space->pool = pool;
+  // The caller holds one of the limit have counts and found the free list
+  // empty, so every space made so far is held by another caller.
+  space->index = atomic_fetch_add (&pool->made, 1);
+  assert (space->index < (unsigned) pool->limit);
+  pool->spaces[space->index] = space;
+  return space;
 }
 
+// Pop the top space off pool's free list, or return NULL if it is empty.
+static space_t *pop_space (pool_t *pool)
+{
+  uint64_t head = atomic_load_explicit (&pool->head, memory_order_acquire);
+  uint64_t next;
+  space_t *space;
+
+  do
+    {
+      if ((uint32_t) head == 0)
+        return NULL;
+      space = pool->spaces[(uint32_t) head - 1];
+      next = ((head >> 32) + 1) << 32
+             | atomic_load_explicit (&space->next, memory_order_relaxed);
+    }
+  while (!atomic_compare_exchange_weak_explicit (&pool->head, &head, next,
+                                                 memory_order_acquire,
+                                                 memory_order_acquire));
+  return space;
+}
+
+// Push space onto its pool's free list.
+static void push_space (pool_t *pool, space_t *space)
+{
+  uint64_t head = atomic_load_explicit (&pool->head, memory_order_relaxed);
+  uint64_t top;
+
+  do
+    {
+      atomic_store_explicit (&space->next, (uint32_t) head,
+                             memory_order_relaxed);
+      top = ((head >> 32) + 1) << 32 | (space->index + 1);
+    }
+  while (!atomic_compare_exchange_weak_explicit (&pool->head, &head, top,
+                                                 memory_order_release,
+                                                 memory_order_relaxed));
+}
 
+// Get a space from pool, making one if none is free and the limit allows,
+// or else waiting for one to be returned.
 space_t *get_space(pool_t *pool)
 {
   space_t *space;
+  int used, high;
   get_lock(pool->have);
-  get_lock(pool->safe);
-  space = pool->head;
-  pool->head = space->next;
+  space = pop_space(pool);
+  if (space == NULL)
+    space = pool_space(pool);
+  used = atomic_fetch_add_explicit(&pool->used, 1, memory_order_relaxed) + 1;
+  high = atomic_load_explicit(&pool->high, memory_order_relaxed);
+  while (used > high
+         && !atomic_compare_exchange_weak_explicit(&pool->high, &high, used,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+    ;
   space->len = 0;
-  release_lock(pool->safe);
+  atomic_store(&space->use, 1);
   return space;
 }
 
+// Report how many spaces pool has made, and the most that were ever in use
+// at once, against its limit, so that the limit can be sized to the work.
+void pool_stats (pool_t *pool, int *made, int *high, int *limit)
+{
+  *made = atomic_load (&pool->made);
+  *high = atomic_load (&pool->high);
+  *limit = pool->limit;
+}
+
 
+// Take one more use of space, so that it outlives the job it was got for.
+void use_space(space_t *space)
+{
+  atomic_fetch_add(&space->use, 1);
+}
+
+
+static void drop_slice (space_t *space);
+
+// Give up one use of space, returning it when nobody is using it anymore.
 void drop_space(space_t* space)
 {
   if (space == NULL)
     return;
+  if (atomic_fetch_sub(&space->use, 1) != 1)
+    return;
+  if (space->window != NULL)
+    {
+      drop_slice(space);
+      return;
+    }
   pool_t *pool = space->pool;
-  get_lock(pool->safe);
-  space->next = pool->head;
-  pool->head = space;
   space->len = 0;
+  atomic_fetch_sub_explicit(&pool->used, 1, memory_order_relaxed);
+  push_space(pool, space);
   release_lock(pool->have);
-  release_lock(pool->safe);
 }
 
 // Destroy the pool.
@@ -233,45 +466,433 @@ void drop_space(space_t* space)
 void free_pool(pool_t* pool)
 {
   space_t *space;
-  while(pool->head != NULL)
+  struct chunk *chunk;
+  int i;
+  for (i = 0; i < atomic_load(&pool->made); ++i)
+    {
+      space = pool->spaces[i];
+      if (pool->huge)
+        {
+          free(space->job);
+          free(space);
+        }
+      else
+        {
+          uncount_memory(pool->size);
+          free_space(space);
+        }
+    }
+  free(pool->spaces);
+  while ((chunk = pool->chunks) != NULL)
     {
-      space = pool->head;
-      pool->head = space->next;
-      free_space(space);
+      pool->chunks = chunk->next;
+      uncount_memory(chunk->len);
+      free(chunk->mem);
+      free(chunk);
     }
   free_lock(pool->safe);
   free_lock(pool->have);
   free(pool);
 }
 
+// -- NUMA placement --
+
+// With --numa the compression threads are dealt out to the NUMA nodes the
+// process may run on, each thread pinned to the CPUs of its node, and each
+// node gets pools of its own whose memory is bound to it. The reader gives a
+// job spaces from the pools of the node whose thread the job is dealt to, so
+// that deflate reads its input and writes its output in local memory. The
+// layout comes from sysfs, so no NUMA library is needed; with no sysfs, or
+// only one usable node, there is nothing to place.
+
+struct numa_t
+{
+  int nodes;          // nodes with CPUs the process may run on
+  int *id;            // kernel number of each node
+  cpu_set_t *cpus;    // the CPUs of each node the process may run on
+};
+
+// Read the start of the text file at path into buf, of size bytes, and end
+// it with a null. Return 0, or -1 if the file could not be read.
+static int read_text (char const *path, char *buf, size_t size)
+{
+  ssize_t got;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  got = read (fd, buf, size - 1);
+  close (fd);
+  if (got <= 0)
+    return -1;
+  buf[got] = 0;
+  return 0;
+}
+
+// Read a sysfs list such as "0-3,8-11" from path into set. Return 0, or -1
+// if the file could not be read.
+static int read_list (char const *path, cpu_set_t *set)
+{
+  char buf[4096], *p, *end;
+  unsigned long lo, hi;
+
+  CPU_ZERO (set);
+  if (read_text (path, buf, sizeof buf) != 0)
+    return -1;
+  for (p = buf; '0' <= *p && *p <= '9'; p = end + (*end == ','))
+    {
+      lo = hi = strtoul (p, &end, 10);
+      if (*end == '-')
+        hi = strtoul (end + 1, &end, 10);
+      for (; lo <= hi && lo < CPU_SETSIZE; ++lo)
+        CPU_SET (lo, set);
+    }
+  return 0;
+}
+
+// Return the NUMA nodes the process may run on, or NULL if there are fewer
+// than two of them.
+numa_t *new_numa (void)
+{
+  cpu_set_t online, allowed, cpus;
+  char path[64];
+  numa_t *numa;
+  int node;
+
+  if (read_list ("/sys/devices/system/node/online", &online) != 0
+      || sched_getaffinity (0, sizeof allowed, &allowed) != 0)
+    return NULL;
+  numa = Malloc (sizeof (numa_t));
+  numa->nodes = 0;
+  numa->id = Malloc (CPU_COUNT (&online) * sizeof (int));
+  numa->cpus = Malloc (CPU_COUNT (&online) * sizeof (cpu_set_t));
+  for (node = 0; node < CPU_SETSIZE; ++node)
+    {
+      if (!CPU_ISSET (node, &online))
+        continue;
+      sprintf (path, "/sys/devices/system/node/node%d/cpulist", node);
+      if (read_list (path, &cpus) != 0)
+        continue;
+      CPU_AND (&cpus, &cpus, &allowed);
+      if (CPU_COUNT (&cpus) == 0)
+        continue;
+      numa->id[numa->nodes] = node;
+      numa->cpus[numa->nodes++] = cpus;
+    }
+  if (numa->nodes < 2)
+    {
+      free_numa (numa);
+      return NULL;
+    }
+  return numa;
+}
+
+void free_numa (numa_t *numa)
+{
+  free (numa->id);
+  free (numa->cpus);
+  free (numa);
+}
+
+int numa_nodes (numa_t *numa)
+{
+  return numa->nodes;
+}
+
+// Return the kernel's number for node.
+int numa_node_id (numa_t *numa, int node)
+{
+  return numa->id[node];
+}
+
+// Keep the calling thread on the CPUs of node.
+static void place_thread (numa_t *numa, int node)
+{
+  pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t),
+                          &numa->cpus[node]);
+}
+
+// Ask for the pages of len bytes at addr, which must be page aligned, to be
+// put on the node the kernel numbers node, if there is room there.
+static void bind_node (void *addr, size_t len, int node)
+{
+#ifdef SYS_mbind
+  enum { MPOL_PREFERRED_MODE = 1, LONG_BITS = CHAR_BIT * sizeof (long) };
+  unsigned long mask[node / LONG_BITS + 1];
+
+  memset (mask, 0, sizeof mask);
+  mask[node / LONG_BITS] = 1UL << node % LONG_BITS;
+  syscall (SYS_mbind, addr, len, MPOL_PREFERRED_MODE, mask,
+           sizeof mask * CHAR_BIT + 1, 0);
+#endif
+}
+
+
+// -- CPU budget --
+
+// By default there is one compression thread per CPU the process may use:
+// the CPUs in its affinity mask, but no more than the CFS bandwidth quota of
+// its cgroup lets it keep busy, so that a container limited to 4 CPUs on a
+// 96-core machine runs 4 threads and is not throttled for running 96. The
+// quota is cpu.max in cgroup v2, or cpu.cfs_quota_us over cpu.cfs_period_us
+// in v1, the smallest found from the process's cgroup up to the root of the
+// hierarchy, rounded up to whole CPUs. The cgroup holding that quota is kept,
+// so that its cpu.stat can tell how often the process was throttled. Where
+// the hierarchies are mounted is read from /proc/self/mountinfo.
+
+static char quota_dir[PATH_MAX]; // cgroup with the quota, or empty for none
+static double quota_cpus;        // CPUs the quota allows, or 0 for no quota
+static int quota_v2;             // quota_dir is in the cgroup v2 hierarchy
+
+// Return nonzero if the comma separated list has token in it.
+static int has_token (char const *list, char const *token)
+{
+  size_t len = strlen (token);
+  while (list != NULL)
+    {
+      if (strncmp (list, token, len) == 0
+          && (list[len] == ',' || list[len] == 0))
+        return 1;
+      list = strchr (list, ',');
+      if (list != NULL)
+        list++;
+    }
+  return 0;
+}
+
+// Copy to dir, of size bytes, the directory of the process's cgroup in the
+// cgroup v2 hierarchy if v2, else in the v1 hierarchy with the cpu
+// controller, and set *base to the length of the hierarchy's mount point.
+// Return 0, or -1 if there is no such hierarchy.
+static int cgroup_dir (int v2, char *dir, size_t size, size_t *base)
+{
+  char line[PATH_MAX * 2 + 256], root[PATH_MAX], mount[PATH_MAX];
+  char type[64], options[256], *sep, *path, *controllers;
+  int found = 0;
+  FILE *f;
+
+  f = fopen ("/proc/self/mountinfo", "r");
+  if (f == NULL)
+    return -1;
+  while (!found && fgets (line, sizeof line, f) != NULL)
+    {
+      sep = strstr (line, " - ");
+      if (sep == NULL
+          || sscanf (line, "%*d %*d %*s %4095s %4095s", root, mount) != 2
+          || sscanf (sep + 3, "%63s %*s %255s", type, options) != 2)
+        continue;
+      found = v2 ? strcmp (type, "cgroup2") == 0
+                 : strcmp (type, "cgroup") == 0 && has_token (options, "cpu");
+    }
+  fclose (f);
+  if (!found)
+    return -1;
+
+  f = fopen ("/proc/self/cgroup", "r");
+  if (f == NULL)
+    return -1;
+  found = 0;
+  while (!found && fgets (line, sizeof line, f) != NULL)
+    {
+      line[strcspn (line, "\n")] = 0;
+      controllers = strchr (line, ':');
+      if (controllers == NULL || (path = strchr (++controllers, ':')) == NULL)
+        continue;
+      *path++ = 0;
+      found = v2 ? strncmp (line, "0:", 2) == 0 && *controllers == 0
+                 : has_token (controllers, "cpu");
+    }
+  fclose (f);
+  if (!found)
+    return -1;
+
+  // the mount may show only part of the hierarchy, from root down
+  if (strcmp (root, "/") != 0)
+    {
+      if (strncmp (path, root, strlen (root)) == 0)
+        path += strlen (root);
+      else
+        path = "";
+    }
+  if (strcmp (path, "/") == 0)
+    path = "";
+  if ((size_t) snprintf (dir, size, "%s%s", mount, path) >= size)
+    return -1;
+  *base = strlen (mount);
+  return 0;
+}
+
+// Return the CPUs the quota of the cgroup at dir allows, or 0 if it has none.
+static double dir_quota (char const *dir, int v2)
+{
+  char path[PATH_MAX + 32], buf[64];
+  double quota, period;
+
+  if (v2)
+    {
+      snprintf (path, sizeof path, "%s/cpu.max", dir);
+      if (read_text (path, buf, sizeof buf) != 0
+          || sscanf (buf, "%lf %lf", &quota, &period) != 2)
+        return 0;
+    }
+  else
+    {
+      snprintf (path, sizeof path, "%s/cpu.cfs_quota_us", dir);
+      if (read_text (path, buf, sizeof buf) != 0
+          || sscanf (buf, "%lf", &quota) != 1)
+        return 0;
+      snprintf (path, sizeof path, "%s/cpu.cfs_period_us", dir);
+      if (read_text (path, buf, sizeof buf) != 0
+          || sscanf (buf, "%lf", &period) != 1)
+        return 0;
+    }
+  // "max" in v2 fails to scan as a number, -1 in v1 means no quota
+  return quota > 0 && period > 0 ? quota / period : 0;
+}
+
+// Find the smallest quota from the process's cgroup up, in the v2 hierarchy
+// and then in v1, and keep it and its cgroup.
+static void find_quota (void)
+{
+  char dir[PATH_MAX];
+  size_t base;
+  double cpus;
+  int v2;
+
+  for (v2 = 1; v2 >= 0; --v2)
+    {
+      if (cgroup_dir (v2, dir, sizeof dir, &base) != 0)
+        continue;
+      for (;;)
+        {
+          cpus = dir_quota (dir, v2);
+          if (cpus > 0 && (quota_cpus == 0 || cpus < quota_cpus))
+            {
+              quota_cpus = cpus;
+              quota_v2 = v2;
+              strcpy (quota_dir, dir);
+            }
+          if (strlen (dir) <= base)
+            break;
+          *strrchr (dir, '/') = 0;
+        }
+    }
+}
+
+// Return the number of compression threads to run when -p is not given.
+int default_processes (void)
+{
+  cpu_set_t allowed;
+  int cpus;
+
+  if (sched_getaffinity (0, sizeof allowed, &allowed) == 0)
+    cpus = CPU_COUNT (&allowed);
+  else
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+  find_quota ();
+  if (quota_cpus > 0 && quota_cpus < cpus)
+    {
+      cpus = (int) quota_cpus;
+      if (cpus < quota_cpus)
+        cpus++;
+    }
+  return cpus;
+}
+
+// Return the CPUs the process's CFS quota allows, or 0 if it has none.
+double cpu_quota (void)
+{
+  return quota_cpus;
+}
+
+// Report the enforcement periods of the cgroup with the quota so far, how
+// many of them it was throttled in, and for how long in all. Return 0, or -1
+// if there is no quota or its statistics cannot be read.
+int cpu_throttling (unsigned long long *periods, unsigned long long *throttled,
+                    uint64_t *ns)
+{
+  char path[PATH_MAX + 32], buf[1024], key[64], *line, *next;
+  unsigned long long value;
+  int found = 0;
+
+  if (quota_cpus == 0)
+    return -1;
+  snprintf (path, sizeof path, "%s/cpu.stat", quota_dir);
+  if (read_text (path, buf, sizeof buf) != 0)
+    return -1;
+  for (line = buf; line != NULL; line = next)
+    {
+      next = strchr (line, '\n');
+      if (next != NULL)
+        *next++ = 0;
+      if (sscanf (line, "%63s %llu", key, &value) != 2)
+        continue;
+      if (strcmp (key, "nr_periods") == 0)
+        {
+          *periods = value;
+          found |= 1;
+        }
+      else if (strcmp (key, "nr_throttled") == 0)
+        {
+          *throttled = value;
+          found |= 2;
+        }
+      // v2 counts microseconds, v1 nanoseconds
+      else if (strcmp (key, quota_v2 ? "throttled_usec"
+                                     : "throttled_time") == 0)
+        {
+          *ns = quota_v2 ? value * 1000 : value;
+          found |= 4;
+        }
+    }
+  return found == 7 ? 0 : -1;
+}
+
+
 // -- job queue used for parallel compression --
 
-// Compress or write job (passed from compress list to write list). If seq is
-// equal to -1, compress_thread is instructed to return; if more is false then
-// this is the last chunk, which after writing tells write_thread to return.
+// Compress or write job (passed from compress list to write list). Sequence
+// numbers run on across files; file says which output the job belongs to, and
+// if more is false then this is the last chunk of that file.
 struct job_t
 {
   long seq;                   // sequence number
+  write_opts *file;           // output file the job is part of
   int more;                   // true if this is not the last chunk
   space_t *in;                // input data to compress
   space_t *out;               // dictionary or resulting compressed data
   space_t *dict;
   u_int32_t check;        // check value for input data
-  lock_t *calc;                 // released when check calculation complete
+  size_t len;                 // length of the input, kept after in is dropped
+  int kind;                   // zlib strategy deflated with, or STORED_BLOCK
+  int level;                  // compression level deflated at
   job_t *next;           // next job in the list (either list)
 };
 
 
-job_t *new_job (long seq, pool_t *in_pool, pool_t *out_pool)
+// Jobs are recycled along with their output spaces: a job holds its output
+// space from start to end, so the space can keep the job_t for the next job
+// it is given, and no job is allocated once the output pool is warm.
+job_t *new_job (long seq, write_opts *file, pool_t *in_pool, pool_t *out_pool)
 {
-  job_t *job = Malloc(sizeof(job_t));
+  space_t *in = in_pool != NULL ? get_space(in_pool) : NULL;
+  space_t *out = get_space(out_pool);
+  job_t *job = out->job;
+  if (job == NULL)
+    job = out->job = Malloc(sizeof(job_t));
   job->seq = seq;
+  job->file = file;
   job->more = 1;
-  job->in = get_space(in_pool);
-  job->out = get_space(out_pool);
+  job->in = in;
+  job->out = out;
   job->dict = NULL;
   job->check = 0;
-  job->calc = new_lock(1, 1);
+  job->len = 0;
+  job->kind = Z_DEFAULT_STRATEGY;
+  job->level = 0;
   job->next = NULL;
   return job;
 }
@@ -282,23 +903,59 @@ void set_last_job(job_t *job)
   job->more = 0;
 }
 
-void set_dictionary (job_t *prev_job, job_t *next_job, pool_t *dict_pool)
+// Let next_job use the input of prev_job, which comes just before it, as its
+// dictionary. The input space stays in use until both jobs are done with it.
+void set_dictionary (job_t *prev_job, job_t *next_job)
 {
   if (prev_job==NULL || next_job==NULL)
     return;
-  next_job->dict = get_space(dict_pool);
-  assert(prev_job->in->len >= DICT);
-  memcpy(next_job->dict->buf, prev_job->in->buf + (prev_job->in->len - DICT), DICT);
-  next_job->dict->len = DICT;
+  use_space(prev_job->in);
+  next_job->dict = prev_job->in;
 }
 
-int load_job (job_t *job, int input_fd)
+// Read into job's input until it holds len bytes, counting any already put
+// there, looping over short reads (pipes and sockets hand out 64K or less at
+// a time) until the block is full or the input ends.  Return how many bytes
+// the input holds: fewer than len only at the end of the input, or
+// (size_t) -1 on a read error.
+size_t load_job (job_t *job, int input_fd, size_t len)
 {
   space_t *space = job->in;
-  space->len = Read(input_fd, space->buf, space->size);
+  ssize_t got;
+  if (len > space->size)
+    len = space->size;
+  while (space->len < len)
+    {
+      got = read (input_fd, space->buf + space->len, len - space->len);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+        return (size_t) -1;
+      if (got == 0)
+        break;
+      space->len += got;
+    }
   return space->len;
 }
 
+// Cut job's input where rsync_cut says to, and return how many bytes it read
+// beyond the cut. They stay in its space for carry_job.
+size_t cut_job (job_t *job)
+{
+  space_t *space = job->in;
+  size_t len = space->len;
+  space->len = rsync_cut (space->buf, len);
+  return len - space->len;
+}
+
+// Start next_job's input with the len bytes prev_job read beyond its cut.
+// prev_job must not have been scheduled yet.
+void carry_job (job_t *prev_job, job_t *next_job, size_t len)
+{
+  memcpy (next_job->in->buf, prev_job->in->buf + prev_job->in->len, len);
+  next_job->in->len = len;
+}
+
 void finished_processing(job_t *job)
 {
   drop_space(job->dict);
@@ -309,251 +966,1206 @@ void free_job (job_t *job)
 {
   //  drop_space(job->dict);
   //drop_space(job->in);
+  // the job goes back with its output space: it must not be touched after
   drop_space(job->out);
-  free_lock(job->calc);
-  free(job);
 }
 
+// -- memory-mapped input --
+
+// Regular files are not read into pool buffers but mapped into memory a window
+// at a time, and each job's input is a slice pointing straight into the
+// mapping, so the data is never copied into a block. Blocks never straddle
+// windows. A slice is a space like any other, with a use count, and it holds a
+// reference on its window; the window is unmapped when the last slice into it
+// is dropped. When a slice is dropped, after both its own block and the next
+// one, which uses it as a dictionary, are compressed, its pages are given back
+// with MADV_DONTNEED, so that compressing a large file does not keep all of it
+// resident.
+//
+// The map covers the file as it was when it was opened. Before each window
+// is mapped the file is measured again, and if it has shrunk the map ends
+// where the file now does, rather than map pages past its end. Whatever the
+// file holds beyond the map's end, whether appended while it was compressed
+// or left over when it shrank, is for the caller to read() once map_job
+// returns 0. A file can still be cut short under a window that is already
+// mapped, and touching a page past its new end raises SIGBUS. The address
+// and length of each live window are kept in one of MAP_SLOTS fixed slots,
+// published before the window is used and cleared before it is unmapped. A
+// SIGBUS handler that finds the faulting address in a slot maps a page of
+// zeros over the lost page, so the thread carries on, and flags the slot.
+// The handler reads nothing but the slots, so it never touches a window or
+// a map that another thread may be freeing. When the window is released the
+// flag is passed on to its map, which its windows keep alive, and the caller
+// reports it once the file is done. A fault anywhere else, or in a window
+// that found no free slot, kills gzip as it would have without the handler.
+
+#define MAP_WINDOW (64*1024*1024L)
+#define MAP_SLOTS 1024
+
+struct map_window_t
+{
+  unsigned char *addr;      // start of the mapping
+  size_t len;               // length of the mapping
+  atomic_int refs;          // slices into the window, plus the map's own
+  input_map_t *map;         // map the window is part of, and holds on to
+  int slot;                 // its slot in live_windows, or -1 for none
+};
+
+// What the SIGBUS handler knows of a live window.
+typedef struct
+{
+  atomic_int taken;         // the slot belongs to a window
+  _Atomic uintptr_t addr;   // start of the window, or 0 while not published
+  _Atomic size_t len;       // length of the window
+  atomic_int faulted;       // a page of the window was lost to a fault
+} window_slot_t;
+
+struct input_map_t
+{
+  int fd;                   // file being mapped
+  off_t start;              // offset of the first byte to compress
+  off_t pos;                // offset of the next byte to hand out
+  off_t end;                // offset just past the last byte to compress
+  off_t window_end;         // offset just past the current window's data
+  unsigned char *window_pos; // where pos is in the current window
+  map_window_t *window;     // current window, or NULL before the first
+  long page;                // system page size
+  atomic_int refs;          // the caller's, plus one per window
+  atomic_int shrunk;        // set if the file was cut short under a window
+};
+
+static window_slot_t live_windows[MAP_SLOTS];
+static long fault_page;
+static pthread_once_t fault_once = PTHREAD_ONCE_INIT;
+
+// Stand in zeros for a page of a window whose file was cut short under it.
+static void map_fault (int sig, siginfo_t *info, void *context)
+{
+  uintptr_t addr = (uintptr_t) info->si_addr, start;
+  void *page;
+  int i;
+
+  (void) context;
+  for (i = 0; i < MAP_SLOTS; ++i)
+    {
+      start = atomic_load_explicit (&live_windows[i].addr,
+                                    memory_order_acquire);
+      if (start == 0 || addr < start
+          || addr - start >= atomic_load_explicit (&live_windows[i].len,
+                                                   memory_order_relaxed))
+        continue;
+      page = (void *) (addr & ~(uintptr_t) (fault_page - 1));
+      if (mmap (page, fault_page, PROT_READ,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        break;
+      atomic_store (&live_windows[i].faulted, 1);
+      return;
+    }
+  // not ours: fault again, and die of it
+  signal (sig, SIG_DFL);
+}
+
+static void fault_init (void)
+{
+  struct sigaction act;
+
+  fault_page = sysconf (_SC_PAGESIZE);
+  memset (&act, 0, sizeof act);
+  act.sa_sigaction = map_fault;
+  sigemptyset (&act.sa_mask);
+  act.sa_flags = SA_SIGINFO;
+  sigaction (SIGBUS, &act, NULL);
+}
+
+static int next_window (input_map_t *map);
+
+// Map the bytes from start to end of fd, or return NULL if they cannot be
+// mapped, in which case the caller should read them instead.
+input_map_t *new_input_map (int fd, off_t start, off_t end)
+{
+  input_map_t *map;
+  if (start < 0 || end <= start)
+    return NULL;
+  map = Malloc (sizeof(input_map_t));
+  map->fd = fd;
+  map->start = map->pos = map->window_end = start;
+  map->end = end;
+  map->window_pos = NULL;
+  map->window = NULL;
+  map->page = sysconf (_SC_PAGESIZE);
+  atomic_init (&map->refs, 1);
+  atomic_init (&map->shrunk, 0);
+  pthread_once (&fault_once, fault_init);
+  if (!next_window (map) || map->window == NULL)
+    {
+      free (map);
+      return NULL;
+    }
+  return map;
+}
+
+static void unref_map (input_map_t *map)
+{
+  if (atomic_fetch_sub (&map->refs, 1) == 1)
+    free (map);
+}
+
+// Return nonzero if a page of window was lost to a fault.
+static int window_faulted (map_window_t *window)
+{
+  return window->slot >= 0
+         && atomic_load (&live_windows[window->slot].faulted);
+}
+
+static void unref_window (map_window_t *window)
+{
+  window_slot_t *slot;
+
+  if (atomic_fetch_sub (&window->refs, 1) != 1)
+    return;
+  if (window->slot >= 0)
+    {
+      // the handler must not find the window once it is unmapped
+      slot = &live_windows[window->slot];
+      atomic_store_explicit (&slot->addr, 0, memory_order_release);
+      munmap (window->addr, window->len);
+      if (atomic_exchange (&slot->faulted, 0))
+        atomic_store (&window->map->shrunk, 1);
+      atomic_store_explicit (&slot->taken, 0, memory_order_release);
+    }
+  else
+    munmap (window->addr, window->len);
+  unref_map (window->map);
+  free (window);
+}
+
+// Map the window holding the data from map->pos on, or if the file now ends
+// at map->pos, end the map there. Return 0 on failure.
+static int next_window (input_map_t *map)
+{
+  off_t from, to;
+  void *addr;
+  map_window_t *window;
+  struct stat st;
+
+  if (fstat (map->fd, &st) == 0 && st.st_size < map->end)
+    map->end = st.st_size > map->pos ? st.st_size : map->pos;
+  if (map->pos == map->end)
+    return 1;
+  from = map->pos - map->pos % map->page;
+  to = map->end - map->pos > MAP_WINDOW ? map->pos + MAP_WINDOW : map->end;
+  addr = mmap (NULL, to - from, PROT_READ, MAP_PRIVATE, map->fd, from);
+  if (addr == MAP_FAILED)
+    return 0;
+  madvise (addr, to - from, MADV_SEQUENTIAL);
+
+  window = Malloc (sizeof(map_window_t));
+  window->addr = addr;
+  window->len = to - from;
+  atomic_init (&window->refs, 1);
+  window->map = map;
+  atomic_fetch_add (&map->refs, 1);
+  for (window->slot = 0; window->slot < MAP_SLOTS; window->slot++)
+    {
+      int free_slot = 0;
+      if (atomic_compare_exchange_strong (&live_windows[window->slot].taken,
+                                          &free_slot, 1))
+        break;
+    }
+  if (window->slot == MAP_SLOTS)
+    window->slot = -1;
+  else
+    {
+      window_slot_t *slot = &live_windows[window->slot];
+      atomic_store_explicit (&slot->len, window->len, memory_order_relaxed);
+      atomic_store_explicit (&slot->faulted, 0, memory_order_relaxed);
+      atomic_store_explicit (&slot->addr, (uintptr_t) window->addr,
+                             memory_order_release);
+    }
+  if (map->window != NULL)
+    unref_window (map->window);
+  map->window = window;
+  map->window_pos = window->addr + (map->pos - from);
+  map->window_end = to;
+  return 1;
+}
+
+static space_t *new_slice (map_window_t *window, unsigned char *buf,
+                           size_t len)
+{
+  space_t *space = Malloc (sizeof(space_t));
+  atomic_fetch_add (&window->refs, 1);
+  space->buf = buf;
+  space->size = space->len = len;
+  atomic_init (&space->use, 1);
+  space->pool = NULL;
+  space->index = 0;
+  atomic_init (&space->next, 0);
+  space->job = NULL;
+  space->window = window;
+  return space;
+}
+
+// Give back the pages of the slice and release its hold on its window.
+static void drop_slice (space_t *space)
+{
+  map_window_t *window = space->window;
+  long page = sysconf (_SC_PAGESIZE);
+  uintptr_t from = ((uintptr_t) space->buf + page - 1) & ~(uintptr_t) (page - 1);
+  uintptr_t to = ((uintptr_t) space->buf + space->len) & ~(uintptr_t) (page - 1);
+  if (from < to)
+    madvise ((void *) from, to - from, MADV_DONTNEED);
+  unref_window (window);
+  free (space);
+}
+
+// Point job's input at the next len or fewer bytes of the mapped file, and
+// return how many that is: 0 at the end of the file, or (size_t) -1 if the
+// file could not be mapped.
+size_t map_job (input_map_t *map, job_t *job, size_t len)
+{
+  if (map->pos == map->end)
+    return 0;
+  if (map->pos == map->window_end && !next_window (map))
+    return (size_t) -1;
+  if (map->pos == map->end)
+    return 0;
+  if ((off_t) len > map->window_end - map->pos)
+    len = map->window_end - map->pos;
+  job->in = new_slice (map->window, map->window_pos, len);
+  map->window_pos += len;
+  map->pos += len;
+  return len;
+}
+
+// Return the data map_job would hand out next, and set *len to how much of it,
+// up to *len, is mapped in one piece: all of it unless the file ends sooner.
+// The window is mapped again from the next byte on if it ends too soon.
+// Return NULL if the file could not be mapped.
+unsigned char const *map_peek (input_map_t *map, size_t *len)
+{
+  if ((off_t) *len > map->end - map->pos)
+    *len = map->end - map->pos;
+  if ((off_t) *len > map->window_end - map->pos && !next_window (map))
+    return NULL;
+  if ((off_t) *len > map->end - map->pos)
+    *len = map->end - map->pos;
+  return map->window_pos;
+}
+
+// Offset just past the data handed out so far.
+off_t input_map_pos (input_map_t *map)
+{
+  return map->pos;
+}
+
+// Return nonzero if the file was cut short under the map while its data was
+// being compressed, so that some of it was compressed as zeros.
+int input_map_shrunk (input_map_t *map)
+{
+  return atomic_load (&map->shrunk)
+         || (map->window != NULL && window_faulted (map->window));
+}
+
+// Release the map. Windows still referenced by jobs stay mapped until those
+// jobs drop them, and the map stays allocated until its last window goes.
+void free_input_map (input_map_t *map)
+{
+  if (map->window != NULL)
+    unref_window (map->window);
+  unref_map (map);
+}
+
+// The job queues are bounded multi-producer/multi-consumer rings. Every cell
+// carries its own turn counter, so producers and consumers hand jobs over
+// with a single compare-and-swap on the tail or head index and never share a
+// lock. The indices and the cells are each given their own cache line so that
+// the reader, the compression threads and the write thread do not false
+// share. A thread only parks on the queue's condition variables when the ring
+// is really empty (consumers) or really full (producers); the other side only
+// takes the mutex to wake it when it knows somebody is parked.
+
+// An ordered queue (the write queue) is a reorder window instead of a ring.
+// The job with sequence number seq lives in slot seq % capacity, so a job that
+// completes out of order is dropped into its slot in O(1), and each slot has
+// its own wakeup so the single writer only wakes when the exact sequence number
+// it waits for has arrived. The window must be at least as large as the number
+// of jobs that can be in flight at once (the output pool limit), which
+// guarantees that a slot is always empty when its next job arrives. The
+// writer also keeps count of how long it spends writing and how long waiting
+// for its next job, and the queue of how many done jobs are waiting for it,
+// so that the scheduler can tell when output is what holds the work up.
+
+typedef struct
+{
+  atomic_size_t turn;       // position this cell is ready for
+  job_t *job;               // job stored in the cell
+  atomic_long seq;          // job->seq, readable without touching the job
+} __attribute__ ((aligned (CACHE_LINE))) ring_cell_t;
+
+typedef struct
+{
+  _Atomic (job_t *) job;    // completed job waiting to be written, or NULL
+  atomic_int waiting;       // true while the writer is parked on this slot
+  pthread_mutex_t park;
+  pthread_cond_t ready;
+} __attribute__ ((aligned (CACHE_LINE))) reorder_slot_t;
+
 struct job_queue_t
 {
-  job_t *head;     // linked list of jobs
-  job_t *tail;
-  int len;         // length of job linked list
-  lock_t *active;
-  lock_t *use;
-  sig_atomic_t num_threads;
-  int closed;
-  condition_t *queue_update;
+  ring_cell_t *cells;       // ring of capacity cells (unordered queues)
+  reorder_slot_t *slots;    // window of capacity slots (ordered queues)
+  size_t mask;              // capacity - 1, capacity is a power of two
+  _Alignas (CACHE_LINE) atomic_size_t tail;   // next position to fill
+  _Alignas (CACHE_LINE) atomic_size_t head;   // next position to drain
+  _Alignas (CACHE_LINE) atomic_int num_threads; // producers still open
+  atomic_int closed;        // set when the last producer closes the queue
+  atomic_int empty_waiters; // consumers parked on not_empty
+  atomic_int full_waiters;  // producers parked on not_full
+  pthread_mutex_t park;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  _Alignas (CACHE_LINE) atomic_long added; // jobs put in an ordered queue
+  atomic_long taken;        // of which taken out by the writer
+  atomic_ullong write_ns;   // time the writer spent writing
+  atomic_ullong wait_ns;    // time the writer spent waiting for a job
 };
 
-job_queue_t* new_job_queue (int num_threads, int ordered)
+job_queue_t* new_job_queue (int num_threads, int ordered, size_t capacity)
 {
-  job_queue_t *job_q = Malloc (sizeof(job_queue_t));
-  job_q->head = NULL;
-  job_q->tail = NULL;
-  job_q->len = 0;
-  job_q->use = new_lock (1, 1);
-  job_q->active = new_lock (0, 0);
-  job_q->num_threads = num_threads;
-  job_q->closed = 0;
+  size_t i, size;
+  job_queue_t *job_q = Memalign (CACHE_LINE, sizeof(job_queue_t));
+
+  size = 2;
+  while (size < capacity)
+    size <<= 1;
+  job_q->cells = NULL;
+  job_q->slots = NULL;
   if (ordered)
-    job_q->queue_update = new_condition();
+    {
+      job_q->slots = Memalign (CACHE_LINE, size * sizeof(reorder_slot_t));
+      for (i = 0; i < size; ++i)
+        {
+          atomic_init (&job_q->slots[i].job, NULL);
+          atomic_init (&job_q->slots[i].waiting, 0);
+          assert (pthread_mutex_init (&job_q->slots[i].park, NULL) == 0);
+          assert (pthread_cond_init (&job_q->slots[i].ready, NULL) == 0);
+        }
+    }
   else
-    job_q->queue_update = NULL;
+    {
+      job_q->cells = Memalign (CACHE_LINE, size * sizeof(ring_cell_t));
+      for (i = 0; i < size; ++i)
+        {
+          atomic_init (&job_q->cells[i].turn, i);
+          job_q->cells[i].job = NULL;
+          atomic_init (&job_q->cells[i].seq, 0);
+        }
+    }
+  job_q->mask = size - 1;
+  atomic_init (&job_q->tail, 0);
+  atomic_init (&job_q->head, 0);
+  atomic_init (&job_q->num_threads, num_threads);
+  atomic_init (&job_q->closed, 0);
+  atomic_init (&job_q->empty_waiters, 0);
+  atomic_init (&job_q->full_waiters, 0);
+  atomic_init (&job_q->added, 0);
+  atomic_init (&job_q->taken, 0);
+  atomic_init (&job_q->write_ns, 0);
+  atomic_init (&job_q->wait_ns, 0);
+  assert (pthread_mutex_init (&job_q->park, NULL) == 0);
+  assert (pthread_cond_init (&job_q->not_empty, NULL) == 0);
+  assert (pthread_cond_init (&job_q->not_full, NULL) == 0);
   return job_q;
 }
 
-void close_job_queue (job_queue_t *job_q)
+// Try to put job in the ring. Return 0 if the ring is full.
+static int ring_push (job_queue_t *job_q, job_t *job)
 {
-  get_lock(job_q->use);
-  --job_q->num_threads;
-  //fprintf(stderr,"Decremented job queue!");
-  if (job_q->num_threads == 0)
+  ring_cell_t *cell;
+  size_t turn;
+  size_t pos = atomic_load_explicit (&job_q->tail, memory_order_relaxed);
+  for (;;)
     {
-      job_q->closed = 1;
-      //fprintf(stderr,"Closed job queue!");
-      increment_lock(job_q->active);
-      if (job_q->queue_update!=NULL)
-	broadcast_condition (job_q->queue_update);
+      cell = &job_q->cells[pos & job_q->mask];
+      turn = atomic_load_explicit (&cell->turn, memory_order_acquire);
+      if (turn == pos)
+        {
+          if (atomic_compare_exchange_weak_explicit (&job_q->tail, &pos,
+                                                     pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+            break;
+        }
+      else if ((ptrdiff_t) (turn - pos) < 0)
+        return 0;
+      else
+        pos = atomic_load_explicit (&job_q->tail, memory_order_relaxed);
     }
-  release_lock(job_q->use);
+  cell->job = job;
+  atomic_store_explicit (&cell->seq, job->seq, memory_order_relaxed);
+  atomic_store_explicit (&cell->turn, pos + 1, memory_order_release);
+  return 1;
+}
+
+// Try to take a job out of the ring. Return NULL if the ring is empty.
+static job_t *ring_pop (job_queue_t *job_q)
+{
+  ring_cell_t *cell;
+  size_t turn;
+  job_t *job;
+  size_t pos = atomic_load_explicit (&job_q->head, memory_order_relaxed);
+  for (;;)
+    {
+      cell = &job_q->cells[pos & job_q->mask];
+      turn = atomic_load_explicit (&cell->turn, memory_order_acquire);
+      if (turn == pos + 1)
+        {
+          if (atomic_compare_exchange_weak_explicit (&job_q->head, &pos,
+                                                     pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+            break;
+        }
+      else if ((ptrdiff_t) (turn - (pos + 1)) < 0)
+        return NULL;
+      else
+        pos = atomic_load_explicit (&job_q->head, memory_order_relaxed);
+    }
+  job = cell->job;
+  atomic_store_explicit (&cell->turn, pos + job_q->mask + 1,
+                         memory_order_release);
+  return job;
+}
+
+static int ring_empty (job_queue_t *job_q)
+{
+  size_t pos = atomic_load (&job_q->head);
+  size_t turn = atomic_load (&job_q->cells[pos & job_q->mask].turn);
+  return (ptrdiff_t) (turn - (pos + 1)) < 0;
+}
+
+// Sequence number of the job at the head of the ring, or LONG_MAX if the
+// ring is empty. This is only a hint: the job may be gone by the time the
+// caller acts on it.
+static long ring_peek_seq (job_queue_t *job_q)
+{
+  size_t pos = atomic_load_explicit (&job_q->head, memory_order_relaxed);
+  ring_cell_t *cell = &job_q->cells[pos & job_q->mask];
+  if (atomic_load_explicit (&cell->turn, memory_order_acquire) != pos + 1)
+    return LONG_MAX;
+  return atomic_load_explicit (&cell->seq, memory_order_relaxed);
+}
+
+static int ring_full (job_queue_t *job_q)
+{
+  size_t pos = atomic_load (&job_q->tail);
+  size_t turn = atomic_load (&job_q->cells[pos & job_q->mask].turn);
+  return (ptrdiff_t) (turn - pos) < 0;
+}
+
+// Wake one thread parked on cond, if the waiter count says there is one. The
+// fence pairs with the one in the parking paths so that either the waiter sees
+// the ring change or we see the waiter.
+static void wake_parked (job_queue_t *job_q, atomic_int *waiters,
+                         pthread_cond_t *cond)
+{
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_load_explicit (waiters, memory_order_relaxed) == 0)
+    return;
+  pthread_mutex_lock (&job_q->park);
+  pthread_cond_signal (cond);
+  pthread_mutex_unlock (&job_q->park);
+}
+
+void close_job_queue (job_queue_t *job_q)
+{
+  size_t i;
+  if (atomic_fetch_sub (&job_q->num_threads, 1) != 1)
+    return;
+  atomic_store (&job_q->closed, 1);
+  pthread_mutex_lock (&job_q->park);
+  pthread_cond_broadcast (&job_q->not_empty);
+  pthread_mutex_unlock (&job_q->park);
+  if (job_q->slots != NULL)
+    for (i = 0; i <= job_q->mask; ++i)
+      {
+        pthread_mutex_lock (&job_q->slots[i].park);
+        pthread_cond_signal (&job_q->slots[i].ready);
+        pthread_mutex_unlock (&job_q->slots[i].park);
+      }
 }
 
 void free_job_queue (job_queue_t *job_q)// not thread safe
 {
-  free_lock(job_q->active);
-  free_lock(job_q->use);
-  if (job_q->queue_update != NULL)
-    free_condition(job_q->queue_update);
-  free(job_q);
+  size_t i;
+  if (job_q->slots != NULL)
+    for (i = 0; i <= job_q->mask; ++i)
+      {
+        pthread_cond_destroy (&job_q->slots[i].ready);
+        pthread_mutex_destroy (&job_q->slots[i].park);
+      }
+  pthread_cond_destroy (&job_q->not_full);
+  pthread_cond_destroy (&job_q->not_empty);
+  pthread_mutex_destroy (&job_q->park);
+  free (job_q->slots);
+  free (job_q->cells);
+  free (job_q);
 }
 
 
-//get a job from the beginning of the job queue
+//get a job from the beginning of the job queue, waiting if there is none
+//returns NULL once the queue is closed and drained
 //the job should be freed if not put back to job queue after usage
 job_t *get_job_bgn (job_queue_t *job_q)
 {
-  get_lock(job_q->active);
-  get_lock(job_q->use);
-  job_t *ret = job_q->head;
-  if (job_q->head == NULL)
+  job_t *job;
+  for (;;)
     {
-      assert(job_q->len == 0);
-      release_lock(job_q->active);
-      release_lock(job_q->use);
-      return NULL;
+      job = ring_pop (job_q);
+      if (job != NULL)
+        break;
+      if (atomic_load (&job_q->closed))
+        {
+          // every producer has finished, so whatever is left is final
+          job = ring_pop (job_q);
+          if (job == NULL)
+            return NULL;
+          break;
+        }
+      pthread_mutex_lock (&job_q->park);
+      atomic_fetch_add (&job_q->empty_waiters, 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      while (ring_empty (job_q) && !atomic_load (&job_q->closed))
+        pthread_cond_wait (&job_q->not_empty, &job_q->park);
+      atomic_fetch_sub (&job_q->empty_waiters, 1);
+      pthread_mutex_unlock (&job_q->park);
     }
-  job_q->head = job_q->head->next;
-  if (job_q->head == NULL)
-    job_q->tail = NULL;
-  ret->next = NULL;
-  --job_q->len;
-  release_lock(job_q->use);
-  return ret;
+  job->next = NULL;
+  wake_parked (job_q, &job_q->full_waiters, &job_q->not_full);
+  return job;
 }
 
-//get a job from the queue that has the same sequece number as seq
-static job_t __attribute__((optimize("O0"))) *search_job_queue (job_queue_t *job_q, long seq)
+//get the job with sequence number seq from an ordered queue, waiting on its
+//slot until it arrives; returns NULL if the queue is closed without it
+//only one thread may take jobs from an ordered queue
+job_t* get_job_seq (job_queue_t* job_q, long seq)
 {
-  if (job_q == NULL)
-    return NULL;
-  job_t *search = job_q->head;
-  while (search != NULL)
+  reorder_slot_t *slot = &job_q->slots[seq & job_q->mask];
+  job_t *job = atomic_load_explicit (&slot->job, memory_order_acquire);
+  uint64_t start;
+  if (job == NULL)
     {
-      if (search->seq == seq)
-	break;
-      search = search->next;
+      start = now_ns ();
+      pthread_mutex_lock (&slot->park);
+      atomic_store (&slot->waiting, 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      while ((job = atomic_load (&slot->job)) == NULL
+             && !atomic_load (&job_q->closed))
+        pthread_cond_wait (&slot->ready, &slot->park);
+      atomic_store (&slot->waiting, 0);
+      pthread_mutex_unlock (&slot->park);
+      atomic_fetch_add_explicit (&job_q->wait_ns, now_ns () - start,
+                                 memory_order_relaxed);
+      if (job == NULL)
+        return NULL;
     }
-  /*
-  if (search == NULL)
-    printf("Not found\n");
-  else
-    printf("Found\n");
-  */
-  return search;
+  assert (job->seq == seq);
+  atomic_store_explicit (&slot->job, NULL, memory_order_relaxed);
+  atomic_fetch_add_explicit (&job_q->taken, 1, memory_order_relaxed);
+  job->next = NULL;
+  return job;
 }
 
-job_t* get_job_seq (job_queue_t* job_q, int seq)
+// Like get_job_seq, but return NULL at once if that job is not done yet.
+job_t* try_get_job_seq (job_queue_t* job_q, long seq)
 {
-  int keep_looking = 1;
-  job_t *result, *prev;
-  do
+  reorder_slot_t *slot = &job_q->slots[seq & job_q->mask];
+  job_t *job = atomic_load_explicit (&slot->job, memory_order_acquire);
+  if (job == NULL)
+    return NULL;
+  assert (job->seq == seq);
+  atomic_store_explicit (&slot->job, NULL, memory_order_relaxed);
+  atomic_fetch_add_explicit (&job_q->taken, 1, memory_order_relaxed);
+  job->next = NULL;
+  return job;
+}
+
+// Record that the writer spent ns writing.
+static void account_write (job_queue_t *job_q, uint64_t ns)
+{
+  atomic_fetch_add_explicit (&job_q->write_ns, ns, memory_order_relaxed);
+}
+
+// Report how long the writer of an ordered queue has spent writing and
+// waiting for jobs, and how many done jobs are waiting for it now.
+void write_pressure (job_queue_t *job_q, uint64_t *write_ns, uint64_t *wait_ns,
+                     long *depth)
+{
+  *write_ns = atomic_load_explicit (&job_q->write_ns, memory_order_relaxed);
+  *wait_ns = atomic_load_explicit (&job_q->wait_ns, memory_order_relaxed);
+  *depth = atomic_load_explicit (&job_q->added, memory_order_relaxed)
+           - atomic_load_explicit (&job_q->taken, memory_order_relaxed);
+}
+
+//drop a completed job into its slot of an ordered queue and wake the writer
+//if it is waiting for exactly this job
+static void add_job_seq (job_queue_t *job_q, job_t *job)
+{
+  reorder_slot_t *slot = &job_q->slots[job->seq & job_q->mask];
+  job_t *old;
+  atomic_fetch_add_explicit (&job_q->added, 1, memory_order_relaxed);
+  old = atomic_exchange_explicit (&slot->job, job, memory_order_release);
+  assert (old == NULL);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_load_explicit (&slot->waiting, memory_order_relaxed) == 0)
+    return;
+  pthread_mutex_lock (&slot->park);
+  pthread_cond_signal (&slot->ready);
+  pthread_mutex_unlock (&slot->park);
+}
+
+//add a job to the job queue, waiting while the queue is full
+void add_job_end (job_queue_t *job_q, job_t *job)
+{
+  if (job_q->slots != NULL)
     {
-      keep_looking = !job_q->closed;
-      if (!keep_looking)
-	{
-	  result = search_job_queue(job_q, seq);
-	  if (result == NULL)
-	    return NULL;
-	  else
-	    break;
-	}
-      wait_condition (job_q->queue_update);
-      result = search_job_queue (job_q, seq);
-      //reset_condition (job_q->queue_update);
-    } while (result == NULL);
-
-  get_lock(job_q->use);
-  prev = NULL;
-  result = job_q->head;
-  while (result!=NULL && result->seq != seq)
-    {
-      prev = result;
-      result = result->next;
-    }
-  assert (result != NULL);
-  if (prev == NULL)
-    {
-      job_q->head = result->next;
+      add_job_seq (job_q, job);
+      return;
     }
-  else
+  while (!ring_push (job_q, job))
     {
-      prev->next = result->next;
+      pthread_mutex_lock (&job_q->park);
+      atomic_fetch_add (&job_q->full_waiters, 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      while (ring_full (job_q))
+        pthread_cond_wait (&job_q->not_full, &job_q->park);
+      atomic_fetch_sub (&job_q->full_waiters, 1);
+      pthread_mutex_unlock (&job_q->park);
     }
-  --job_q->len;
-  release_lock(job_q->use);
-  result->next = NULL;
+  wake_parked (job_q, &job_q->empty_waiters, &job_q->not_empty);
+}
 
-  return result;
+//the ring has no front to add to and ordered queues place jobs by sequence
+//number, so this is the same as add_job_end
+void add_job_bgn (job_queue_t *job_q, job_t *job)
+{
+  add_job_end (job_q, job);
 }
 
 
-/*job_t* get_job_seq (job_queue_t* job_q, int seq)
+// -- work-stealing scheduler for the compression threads --
+
+// Each compression thread owns a ring of its own. The reader deals jobs out to
+// the rings in turn, so the threads do not all contend for a single queue
+// head. A thread takes jobs from its own ring first; when that is empty it
+// steals from the ring whose head has the lowest sequence number, so that the
+// oldest outstanding jobs are finished first and the writer's reorder window
+// keeps moving even when one thread is held up by a slow block. Only when
+// every ring is empty does a thread park on the scheduler's condition
+// variable. Each thread counts the jobs it ran, the jobs it stole and the time
+// it spent parked. With NUMA placement a thief looks on its own node first,
+// and only takes a job from another node when its node has none.
+//
+// With --target-rate the scheduler also sets the compression level of the
+// jobs the threads take next, so that the threads together compress at about
+// the target rate. The rate is judged on the time the threads spend
+// compressing, not on the wall clock, so a slow reader or writer does not
+// make the level drop. Once TUNE_BLOCKS blocks per thread have been done at
+// the current level, their rate, times the number of threads, is set against
+// the target: below it, the level goes down one; above it, the level goes up
+// one if the rate last seen at the next level up met the target, or, if that
+// level was never tried, if the current one beats the target by TUNE_HEADROOM
+// percent, about what one level up costs. The rate seen at each level is kept
+// as a running average. Stored blocks take the same time at any level and do
+// not count.
+//
+// With --io-boost the level follows the writer instead: when output is what
+// holds the work up, the threads may as well spend the time they would spend
+// waiting for output space on a higher level. After the same TUNE_BLOCKS
+// blocks per thread, if the writer spent more than half of the wall time
+// since the last change writing, with at least a job per thread done and
+// waiting for it, the level goes up one; if it spent more than a quarter of
+// it waiting for the next job, the compression is what it waits on, and the
+// level goes down one, but never below the level asked for.
+
+typedef struct
 {
-    job_t* prev = NULL;
-    job_t* cur = job_q->head;
-    while(1)
-      {
-        if(cur == NULL)
-	  {
-            prev = NULL;
-            cur = job_q->head;
-	    continue;
-	  }
-	printf("Looking at seq %ld and looking for seq %d\n", cur->seq, seq);
-	printf( "%d", job_q->len);
-        if(cur->seq == seq)
-	  {
-            break;
-	  }
-        prev = cur;
-        cur = cur->next;
-      }
+  atomic_ulong jobs;        // jobs compressed by this worker
+  atomic_ulong steals;      // of which taken from another worker's ring
+  atomic_ullong idle_ns;    // time spent parked with no job anywhere
+  atomic_ullong bytes;      // input bytes compressed, read by the reader
+  atomic_ullong busy_ns;    // time spent compressing them
+} __attribute__ ((aligned (CACHE_LINE))) worker_stats_t;
+
+struct scheduler_t
+{
+  int workers;              // number of compression threads
+  job_queue_t **queues;     // one ring per worker
+  worker_stats_t *stats;    // one set of counters per worker
+  int *node;                // NUMA node of each worker, all 0 by default
+  unsigned long next;       // next ring to deal a job to (reader only)
+  double target;            // bytes per ns to compress at, or 0 for none
+  _Alignas (CACHE_LINE) atomic_int level; // level for the next jobs
+  pthread_mutex_t tune;     // serialises the level's adjustment
+  uint64_t tune_bytes;      // bytes done at level since it was set
+  uint64_t tune_ns;         // time spent on them
+  unsigned long tune_jobs;  // blocks they were in
+  double rate[10];          // bytes per ns seen at each level, or 0
+  job_queue_t *writer;      // the writer's queue with --io-boost, else NULL
+  int base;                 // lowest level --io-boost may go down to
+  uint64_t tune_start;      // when the level was set
+  uint64_t tune_write;      // writer's time writing then
+  uint64_t tune_wait;       // writer's time waiting then
+  unsigned long raises;     // times the level went up, since last cleared
+  unsigned long drops;      // times it went down
+  _Alignas (CACHE_LINE) atomic_int idle_waiters; // workers parked
+  atomic_int closed;        // set when no more jobs will be scheduled
+  pthread_mutex_t park;
+  pthread_cond_t wake;
+};
+
+uint64_t now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    get_lock(job_q->active);
-    get_lock(job_q->use);
-    if(prev == NULL) {
-        job_q->head = job_q->head->next;
-        if (job_q->head == NULL) {
-            job_q->tail = NULL;
+scheduler_t *new_scheduler (int workers, size_t capacity)
+{
+  int i;
+  scheduler_t *sched = Memalign (CACHE_LINE, sizeof(scheduler_t));
+  sched->workers = workers;
+  sched->queues = Malloc (workers * sizeof(job_queue_t *));
+  for (i = 0; i < workers; ++i)
+    sched->queues[i] = new_job_queue (1, 0, capacity);
+  sched->node = Calloc (workers, sizeof(int));
+  sched->stats = Memalign (CACHE_LINE, workers * sizeof(worker_stats_t));
+  memset (sched->stats, 0, workers * sizeof(worker_stats_t));
+  for (i = 0; i < workers; ++i)
+    {
+      atomic_init (&sched->stats[i].jobs, 0);
+      atomic_init (&sched->stats[i].steals, 0);
+      atomic_init (&sched->stats[i].idle_ns, 0);
+      atomic_init (&sched->stats[i].bytes, 0);
+      atomic_init (&sched->stats[i].busy_ns, 0);
+    }
+  sched->next = 0;
+  sched->target = 0;
+  atomic_init (&sched->level, -1);
+  assert (pthread_mutex_init (&sched->tune, NULL) == 0);
+  sched->tune_bytes = sched->tune_ns = sched->tune_jobs = 0;
+  for (i = 0; i < 10; ++i)
+    sched->rate[i] = 0;
+  sched->writer = NULL;
+  sched->base = 0;
+  sched->tune_start = sched->tune_write = sched->tune_wait = 0;
+  sched->raises = sched->drops = 0;
+  atomic_init (&sched->idle_waiters, 0);
+  atomic_init (&sched->closed, 0);
+  assert (pthread_mutex_init (&sched->park, NULL) == 0);
+  assert (pthread_cond_init (&sched->wake, NULL) == 0);
+  return sched;
+}
+
+// Destroy the scheduler. Not thread safe: the workers must have returned.
+void free_scheduler (scheduler_t *sched)
+{
+  int i;
+  for (i = 0; i < sched->workers; ++i)
+    free_job_queue (sched->queues[i]);
+  pthread_cond_destroy (&sched->wake);
+  pthread_mutex_destroy (&sched->park);
+  pthread_mutex_destroy (&sched->tune);
+  free (sched->stats);
+  free (sched->node);
+  free (sched->queues);
+  free (sched);
+}
+
+// Deal a job to the next worker's ring and wake a parked worker, if any.
+// Only one thread may schedule jobs.
+void schedule_job (scheduler_t *sched, job_t *job)
+{
+  job_queue_t *job_q = sched->queues[sched->next++ % sched->workers];
+  add_job_end (job_q, job);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_load_explicit (&sched->idle_waiters, memory_order_relaxed) == 0)
+    return;
+  pthread_mutex_lock (&sched->park);
+  pthread_cond_signal (&sched->wake);
+  pthread_mutex_unlock (&sched->park);
+}
+
+// Note that worker runs on node.
+void scheduler_place (scheduler_t *sched, int worker, int node)
+{
+  sched->node[worker] = node;
+}
+
+// Return the node of the worker that the job ahead jobs after the next one
+// to be scheduled will be dealt to.
+int scheduler_node (scheduler_t *sched, unsigned long ahead)
+{
+  return sched->node[(sched->next + ahead) % sched->workers];
+}
+
+// No more jobs will be scheduled: let the workers drain the rings and return.
+void close_scheduler (scheduler_t *sched)
+{
+  atomic_store (&sched->closed, 1);
+  pthread_mutex_lock (&sched->park);
+  pthread_cond_broadcast (&sched->wake);
+  pthread_mutex_unlock (&sched->park);
+}
+
+static int scheduler_empty (scheduler_t *sched)
+{
+  int i;
+  for (i = 0; i < sched->workers; ++i)
+    if (!ring_empty (sched->queues[i]))
+      return 0;
+  return 1;
+}
+
+// Return the ring other than worker's, on node or on any node if node is -1,
+// whose head has the lowest sequence number, or -1 if they are all empty.
+static int oldest_ring (scheduler_t *sched, int worker, int node)
+{
+  int i, victim = -1;
+  long seq, lowest = LONG_MAX;
+  for (i = 0; i < sched->workers; ++i)
+    {
+      if (i == worker || (node >= 0 && sched->node[i] != node))
+        continue;
+      seq = ring_peek_seq (sched->queues[i]);
+      if (seq < lowest)
+        {
+          lowest = seq;
+          victim = i;
         }
-        --job_q->len;
-        cur->next = NULL;
-        release_lock(job_q->use);
-        return cur;
-    } else {
-        prev->next = cur->next;
-        if (job_q->head == NULL) {
-            job_q->tail = NULL;
+    }
+  return victim;
+}
+
+// Steal the job with the lowest sequence number at the head of another
+// worker's ring, on the worker's own node if there is one there. Returns NULL
+// if there was none, or if another thief got there first.
+static job_t *steal_job (scheduler_t *sched, int worker)
+{
+  int victim = oldest_ring (sched, worker, sched->node[worker]);
+  if (victim < 0)
+    victim = oldest_ring (sched, worker, -1);
+  if (victim < 0)
+    return NULL;
+  return ring_pop (sched->queues[victim]);
+}
+
+// Get the next job for worker, from its own ring or stolen from another,
+// waiting if there is none. Returns NULL once the scheduler is closed and
+// every ring is drained.
+job_t *get_job_worker (scheduler_t *sched, int worker)
+{
+  worker_stats_t *stats = &sched->stats[worker];
+  job_queue_t *own = sched->queues[worker];
+  job_t *job;
+  uint64_t start;
+  for (;;)
+    {
+      job = ring_pop (own);
+      if (job != NULL)
+        break;
+      job = steal_job (sched, worker);
+      if (job != NULL)
+        {
+          atomic_fetch_add_explicit (&stats->steals, 1, memory_order_relaxed);
+          break;
         }
-        --job_q->len;
-        cur->next = NULL;
-        release_lock(job_q->use);
-        return cur;
+      if (!scheduler_empty (sched))
+        continue;
+      if (atomic_load (&sched->closed) && scheduler_empty (sched))
+        return NULL;
+      start = now_ns ();
+      pthread_mutex_lock (&sched->park);
+      atomic_fetch_add (&sched->idle_waiters, 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      while (scheduler_empty (sched) && !atomic_load (&sched->closed))
+        pthread_cond_wait (&sched->wake, &sched->park);
+      atomic_fetch_sub (&sched->idle_waiters, 1);
+      pthread_mutex_unlock (&sched->park);
+      atomic_fetch_add_explicit (&stats->idle_ns, now_ns () - start,
+                                 memory_order_relaxed);
     }
+  atomic_fetch_add_explicit (&stats->jobs, 1, memory_order_relaxed);
+  job->next = NULL;
+  return job;
 }
-*/
 
+#define TUNE_BLOCKS 2
+#define TUNE_HEADROOM 30
 
+// Have the threads compress at about rate bytes per second, starting at
+// level. Only call this before any job is scheduled.
+void scheduler_target (scheduler_t *sched, double rate, int level)
+{
+  sched->target = rate / 1e9;
+  atomic_store (&sched->level, level);
+}
 
-//add a job to the beginning of the job queue
-void add_job_bgn (job_queue_t *job_q, job_t *job)
+// Raise the threads' level above level while the writer of write_q is
+// what holds them up. Only call this before any job is scheduled.
+void scheduler_boost (scheduler_t *sched, job_queue_t *write_q, int level)
 {
-  get_lock(job_q->use);
-  if (job_q->head == NULL)
-    job_q->tail = job;
-  job->next = job_q->head;
-  job_q->head = job;
-  ++job_q->len;
-  increment_lock(job_q->active);
-  release_lock(job_q->use);
-  signal_condition(job_q->queue_update);
+  long depth;
+  sched->writer = write_q;
+  sched->base = level;
+  sched->tune_start = now_ns ();
+  write_pressure (write_q, &sched->tune_write, &sched->tune_wait, &depth);
+  atomic_store (&sched->level, level);
 }
 
-//add a job to the end of the job queue
-void add_job_end (job_queue_t *job_q, job_t *job)
+// Return the level for the next job, or -1 if the level is not tuned.
+int scheduler_level (scheduler_t *sched)
 {
-  get_lock(job_q->use);
-  if (job_q->tail == NULL)
-  {
-    assert(job_q->head == NULL);
-    job_q->head = job;
-    job_q->tail = job;
-  }
-  else
-  {
-    job_q->tail->next = job;
-    job_q->tail = job;
-  }
-  job->next = NULL;
-  ++job_q->len;
-  increment_lock(job_q->active);
-  release_lock(job_q->use);
+  return atomic_load_explicit (&sched->level, memory_order_relaxed);
+}
+
+// Return the level after level for the target rate, given the bytes per ns
+// the threads together did at level.
+static int rate_level (scheduler_t *sched, double rate, int level)
+{
+  double *seen = &sched->rate[level];
+  *seen = *seen == 0 ? rate : (*seen + rate) / 2;
+  if (rate < sched->target && level > 1)
+    return level - 1;
+  if (rate > sched->target && level < 9
+      && (sched->rate[level + 1] != 0
+          ? sched->rate[level + 1] >= sched->target
+          : rate * 100 >= sched->target * (100 + TUNE_HEADROOM)))
+    return level + 1;
+  return level;
+}
+
+// Return the level after level for --io-boost, given how the writer spent
+// its time since the level was set.
+static int boost_level (scheduler_t *sched, int level)
+{
+  uint64_t now = now_ns (), wall = now - sched->tune_start;
+  uint64_t write_ns, wait_ns;
+  long depth;
+
+  write_pressure (sched->writer, &write_ns, &wait_ns, &depth);
+  if ((write_ns - sched->tune_write) * 2 > wall && depth >= sched->workers
+      && level < 9)
+    level++;
+  else if ((wait_ns - sched->tune_wait) * 4 > wall && level > sched->base)
+    level--;
+  sched->tune_start = now;
+  sched->tune_write = write_ns;
+  sched->tune_wait = wait_ns;
+  return level;
+}
+
+// Move the level towards the target rate, or the writer's pace with
+// --io-boost, after a job at it was done.
+static void tune_level (scheduler_t *sched, size_t len, uint64_t ns, int level)
+{
+  int old = level;
+
+  pthread_mutex_lock (&sched->tune);
+  // jobs still running at an earlier level say nothing about this one
+  if (level != atomic_load (&sched->level) || ns == 0)
+    {
+      pthread_mutex_unlock (&sched->tune);
+      return;
+    }
+  sched->tune_bytes += len;
+  sched->tune_ns += ns;
+  if (++sched->tune_jobs >= (unsigned long) TUNE_BLOCKS * sched->workers)
+    {
+      if (sched->writer != NULL)
+        level = boost_level (sched, level);
+      else
+        level = rate_level (sched, (double) sched->tune_bytes
+                                   / sched->tune_ns * sched->workers, level);
+      sched->raises += level > old;
+      sched->drops += level < old;
+      atomic_store (&sched->level, level);
+      sched->tune_bytes = sched->tune_ns = sched->tune_jobs = 0;
+    }
+  pthread_mutex_unlock (&sched->tune);
+}
+
+// Report how many times the level went up and down since the counts were
+// last cleared.
+void scheduler_changes (scheduler_t *sched, unsigned long *raises,
+                        unsigned long *drops)
+{
+  pthread_mutex_lock (&sched->tune);
+  *raises = sched->raises;
+  *drops = sched->drops;
+  pthread_mutex_unlock (&sched->tune);
+}
+
+// Start counting the level's changes again from zero.
+void scheduler_clear_changes (scheduler_t *sched)
+{
+  pthread_mutex_lock (&sched->tune);
+  sched->raises = sched->drops = 0;
+  pthread_mutex_unlock (&sched->tune);
+}
+
+// Record that worker spent ns compressing a block of len bytes at level, or
+// -1 if it was stored.
+void account_job (scheduler_t *sched, int worker, size_t len, uint64_t ns,
+                  int level)
+{
+  worker_stats_t *stats = &sched->stats[worker];
+  atomic_fetch_add_explicit (&stats->bytes, len, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats->busy_ns, ns, memory_order_relaxed);
+  if ((sched->target != 0 || sched->writer != NULL) && level >= 0)
+    tune_level (sched, len, ns, level);
+}
+
+// Total bytes compressed and time spent compressing them, over all workers.
+void scheduler_rate (scheduler_t *sched, uint64_t *bytes, uint64_t *ns)
+{
+  int i;
+  *bytes = *ns = 0;
+  for (i = 0; i < sched->workers; ++i)
+    {
+      *bytes += atomic_load_explicit (&sched->stats[i].bytes,
+                                      memory_order_relaxed);
+      *ns += atomic_load_explicit (&sched->stats[i].busy_ns,
+                                   memory_order_relaxed);
+    }
+}
+
+// Print the per-worker job, steal and idle counters. The workers may still
+// be counting, so each counter is taken and zeroed in one exchange: the
+// workers outlive the file, and the next one is counted from zero.
+void print_scheduler_stats (scheduler_t *sched, FILE *stream)
+{
+  int i;
+  worker_stats_t *stats;
+  unsigned long jobs, steals;
+  uint64_t idle_ns;
+  for (i = 0; i < sched->workers; ++i)
+    {
+      stats = &sched->stats[i];
+      jobs = atomic_exchange_explicit (&stats->jobs, 0, memory_order_relaxed);
+      steals = atomic_exchange_explicit (&stats->steals, 0,
+                                         memory_order_relaxed);
+      idle_ns = atomic_exchange_explicit (&stats->idle_ns, 0,
+                                          memory_order_relaxed);
+      fprintf (stream, "  worker %d: %lu jobs, %lu stolen, %.3f ms idle\n",
+               i, jobs, steals, idle_ns / 1e6);
+    }
+}
+
+
+// -- per-worker arena for zlib's allocations --
+
+// Each compression thread gives its deflate stream a zalloc and zfree that
+// carve zlib's state, window, hash chains and pending buffer out of one block
+// the thread allocates when it starts, and frees when it ends. zlib only
+// allocates in deflateInit2, and the stream lives as long as the thread, so
+// once the threads are up no file and no deflateReset touches the heap. The
+// block is big enough for a stream with a 32K window at memLevel 8, as zlib
+// sizes it; should a zlib need more, the rest comes from malloc. With huge
+// pages the block is rounded up to a huge page and advised as one.
+
+#define ARENA ((1U << (15 + 2)) + (1U << (8 + 9)) + 0x4000U)
+
+typedef struct
+{
+  unsigned char *base;        // the block
+  size_t size;                // its size
+  size_t used;                // bytes handed out so far
+} arena_t;
+
+// Return the size of a compression thread's arena.
+size_t arena_memory (int huge)
+{
+  long page = sysconf (_SC_PAGESIZE);
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    return (ARENA + HUGE_PAGE - 1) & ~(size_t) (HUGE_PAGE - 1);
+#endif
+  return (ARENA + page - 1) & ~(size_t) (page - 1);
+}
+
+static void arena_init (arena_t *arena, int huge)
+{
+  size_t align = sysconf (_SC_PAGESIZE);
+  arena->size = arena_memory (huge);
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    align = HUGE_PAGE;
+#endif
+  arena->base = Memalign (align, arena->size);
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise (arena->base, arena->size, MADV_HUGEPAGE);
+#endif
+  arena->used = 0;
+  count_memory (arena->size);
+}
+
+static voidpf arena_alloc (voidpf opaque, uInt items, uInt size)
+{
+  arena_t *arena = opaque;
+  size_t len = ((size_t) items * size + CACHE_LINE - 1)
+               & ~(size_t) (CACHE_LINE - 1);
+  void *mem;
+  if (arena->size - arena->used < len)
+    return malloc ((size_t) items * size);
+  mem = arena->base + arena->used;
+  arena->used += len;
+  return mem;
+}
+
+// Memory from the block is only given back all at once, by arena_free.
+static void arena_release (voidpf opaque, voidpf mem)
+{
+  arena_t *arena = opaque;
+  if ((unsigned char *) mem < arena->base
+      || (unsigned char *) mem >= arena->base + arena->size)
+    free (mem);
+}
+
+static void arena_free (arena_t *arena)
+{
+  uncount_memory (arena->size);
+  free (arena->base);
 }
 
 
 struct compress_options {
-  job_queue_t *job_queue;
+  scheduler_t *scheduler;
+  int worker;
   int level;
+  int strategy;               // zlib strategy, or AUTO_STRATEGY per block
   job_queue_t *write_job_queue;
+  numa_t *numa;               // NUMA nodes, or NULL to run anywhere
+  int node;                   // node of numa to run on
+  int huge;                   // put the zlib arena on huge pages
 };
 
-compress_options *new_compress_options(job_queue_t *job_queue, job_queue_t* write_job_queue, int level)
+compress_options *new_compress_options(scheduler_t *scheduler, int worker, job_queue_t* write_job_queue, int level, int strategy, numa_t *numa, int node, int huge)
 {
   compress_options *copts = Malloc(sizeof(compress_options));
-  copts->job_queue = job_queue;
+  copts->scheduler = scheduler;
+  copts->worker = worker;
   copts->level = level;
+  copts->strategy = strategy;
   copts->write_job_queue = write_job_queue;
+  copts->numa = numa;
+  copts->node = node;
+  copts->huge = huge;
+  if (numa != NULL)
+    scheduler_place(scheduler, worker, node);
   return copts;
 }
 
@@ -565,17 +2177,200 @@ void free_compress_options(compress_options *compress_options)
 void deflate_engine (z_stream *strm, job_t *job)
 {
   int ret;
-  strm->next_in = job->in->buf;
+  // an empty input has no space at all when it is mapped
+  unsigned char *next = job->in != NULL ? job->in->buf : NULL;
+  size_t left = job->in != NULL ? job->in->len : 0;
+  uint32_t check = 0;
   strm->next_out = job->out->buf;
-  strm->avail_in = job->in->len;
   strm->avail_out = job->out->size;
   int flush = (job->more == 0) ? Z_FINISH : Z_SYNC_FLUSH;
-  ret = deflate (strm, flush);
-  assert (ret != Z_STREAM_ERROR);
+  do {
+    size_t len = left < CRC_STRIDE ? left : CRC_STRIDE;
+    check = crc32_update(check, next, len);
+    strm->next_in = next;
+    strm->avail_in = len;
+    next += len;
+    left -= len;
+    // the output space is sized to hold the whole block, so deflate always
+    // takes all of a stride
+    ret = deflate (strm, left ? Z_NO_FLUSH : flush);
+    assert (ret != Z_STREAM_ERROR && strm->avail_in == 0);
+  } while (left);
   job->out->len = job->out->size - strm->avail_out;
+  job->check = check;
+  job->len = job->in != NULL ? job->in->len : 0;
   return;
 }
 
+// -- content-defined cuts for --rsyncable --
+
+// With --rsyncable the reader cuts the input into blocks where its content
+// says to, not at fixed offsets, and every block is compressed on its own,
+// with no dictionary. A block's compressed data then depends on nothing but
+// its own bytes, and a change to the input changes only the blocks it falls
+// in: the cuts before and after it land where they did, on the same bytes,
+// and the same blocks come out the same, for rsync to find. The cuts are
+// found with a gear hash, rolled over the input a byte at a time by shifting
+// it left one bit and adding a random number for the byte, so that after 64
+// bytes the oldest has shifted out and the hash depends on the last 64 bytes
+// alone. A block ends after the first byte at which the top RSYNC_BITS bits
+// of the hash are all zero, which comes every 2^RSYNC_BITS bytes on average,
+// but not before RSYNC_MIN bytes, so a cut never makes a tiny block, nor
+// after the buffer is full. The random numbers come from a fixed seed: the
+// cuts must fall in the same places every run and with every gzip.
+
+#define RSYNC_MIN (16*1024U)
+#define RSYNC_BITS 16
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fill the gear table with splitmix64 from a fixed seed.
+static void gear_init (void)
+{
+  uint64_t x = 0, z;
+  int i;
+
+  for (i = 0; i < 256; ++i)
+    {
+      z = (x += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Return the length of the block that starts the len bytes at buf: up to and
+// including the first byte where the content says to cut, or len if there
+// is none.
+size_t rsync_cut (unsigned char const *buf, size_t len)
+{
+  uint64_t hash = 0;
+  size_t i;
+
+  pthread_once (&gear_once, gear_init);
+  if (len <= RSYNC_MIN)
+    return len;
+  // start 64 bytes early so the hash is whole by the first place to cut
+  for (i = RSYNC_MIN - 64; i < RSYNC_MIN; ++i)
+    hash = (hash << 1) + gear[buf[i]];
+  for (; i < len; ++i)
+    {
+      hash = (hash << 1) + gear[buf[i]];
+      if ((hash >> (64 - RSYNC_BITS)) == 0)
+        return i + 1;
+    }
+  return len;
+}
+
+
+// -- choosing how to compress each block --
+
+// Before a block is compressed, a sample of it is looked at: SAMPLES windows
+// of SAMPLE bytes spread evenly over the block. If the sample's bytes are
+// spread so evenly over all 256 values that its collision entropy, which is
+// never more than its Shannon entropy, is above about 7.95 bits a byte, deflate
+// could save next to nothing on the block, so it is copied out as stored
+// deflate blocks instead: no match search, no Huffman codes, only a five byte
+// header for every 64K. The test is a count of each byte value in the sample,
+// and the sum of the squares of the counts against the square of the sample
+// size, all in integers. Blocks smaller than the sample are always deflated.
+//
+// With --strategy=auto the same pass also picks the zlib strategy to deflate
+// the block with. It counts the bytes that repeat the one before them, and
+// the four byte strings that were seen before in the same window, through a
+// small table of the last string seen for each hash. A block that is mostly
+// runs is deflated with Z_RLE, which only looks for matches one byte back; a
+// block in which few strings recur is deflated with Z_HUFFMAN_ONLY, which
+// only codes the bytes; anything else gets Z_DEFAULT_STRATEGY. Z_FILTERED is
+// only used when asked for.
+
+#define SAMPLE 4096U
+#define SAMPLES 4
+
+// Bits of the string hash used to find recurring strings.
+#define SEEN_BITS 10
+
+// Most data in one stored block.
+#define STORED_MAX 65535U
+
+// Return how to compress the len bytes at buf: STORED_BLOCK if they look
+// incompressible, else strategy, or if that is AUTO_STRATEGY the zlib
+// strategy that suits them.
+int block_strategy (unsigned char const *buf, size_t len, int strategy)
+{
+  unsigned count[256];
+  uint32_t seen[1U << SEEN_BITS], str, *slot;
+  unsigned char const *p, *end;
+  uint64_t squares = 0, n = (uint64_t) SAMPLES * SAMPLE;
+  unsigned long runs = 0, repeats = 0;
+  size_t gap;
+  int i;
+
+  if (len < n)
+    return strategy == AUTO_STRATEGY ? Z_DEFAULT_STRATEGY : strategy;
+  memset (count, 0, sizeof count);
+  gap = (len - SAMPLE) / (SAMPLES - 1);
+  for (i = 0; i < SAMPLES; ++i)
+    for (p = buf + i * gap, end = p + SAMPLE; p < end; ++p)
+      count[*p]++;
+  for (i = 0; i < 256; ++i)
+    squares += (uint64_t) count[i] * count[i];
+  // 2^7.95 is 247.3: uniformly random bytes come to about 1.02 n^2 / 256
+  if (squares * 247 < n * n)
+    return STORED_BLOCK;
+  if (strategy != AUTO_STRATEGY)
+    return strategy;
+
+  for (i = 0; i < SAMPLES; ++i)
+    {
+      memset (seen, 0, sizeof seen);
+      p = buf + i * gap;
+      str = p[0] << 16 | p[1] << 8 | p[2];
+      for (end = p + SAMPLE - 3; p < end; ++p)
+        {
+          runs += p[0] == p[1];
+          str = str << 8 | p[3];
+          slot = &seen[(str * 2654435761U) >> (32 - SEEN_BITS)];
+          repeats += *slot == str;
+          *slot = str;
+        }
+    }
+  if (runs * 2 > n)
+    return Z_RLE;
+  if (repeats * 8 < n)
+    return Z_HUFFMAN_ONLY;
+  return Z_DEFAULT_STRATEGY;
+}
+
+// Copy job's input to its output as stored deflate blocks, the last of them
+// final if the job is the last of its file, and compute the check value
+// along the way. The output of the previous job ends on a byte boundary, so
+// each block's three header bits fill a byte of their own.
+static void store_engine (job_t *job)
+{
+  unsigned char *next = job->in->buf, *out = job->out->buf;
+  size_t left = job->in->len, len;
+  uint32_t check = 0;
+  do {
+    len = left < STORED_MAX ? left : STORED_MAX;
+    check = crc32_update (check, next, len);
+    left -= len;
+    *out++ = left == 0 && job->more == 0;
+    *out++ = len;
+    *out++ = len >> 8;
+    *out++ = ~len;
+    *out++ = ~len >> 8;
+    memcpy (out, next, len);
+    out += len;
+    next += len;
+  } while (left);
+  job->out->len = out - job->out->buf;
+  job->check = check;
+  job->len = job->in->len;
+  job->kind = STORED_BLOCK;
+}
+
 // Get the next compression job from the head of the list, compress and compute
 // the check value on the input, and put a job in the write list with the
 // results. Keep looking for more jobs, returning when a job is found with a
@@ -585,17 +2380,27 @@ void deflate_engine (z_stream *strm, job_t *job)
 void *compress_thread(void *(opts)) {
   struct job_t *job;              // job pulled and working on
   int ret;                        // for error checking purposes
+  uint64_t start;                 // when compression of the job started
 
   compress_options* options = (compress_options *) opts;
-  job_queue_t *job_queue = options->job_queue;
+  scheduler_t *scheduler = options->scheduler;
+  int worker = options->worker;
   int level = options->level;
+  int kind;                       // how the job is compressed
+  int job_level;                  // level the job is compressed at
   job_queue_t* write_q = options->write_job_queue;
 
-  // Initialize the deflate stream
+  // Move to our node first, so that the deflate state is allocated there
+  if (options->numa != NULL)
+    place_thread(options->numa, options->node);
+
+  // Initialize the deflate stream, its memory from our arena
+  arena_t arena;
+  arena_init(&arena, options->huge);
   z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree  = Z_NULL;
-  strm.opaque = Z_NULL;
+  strm.zalloc = arena_alloc;
+  strm.zfree  = arena_release;
+  strm.opaque = &arena;
   ret = deflateInit2 (&strm, level, Z_DEFLATED,
                           -15, 8,
                           Z_DEFAULT_STRATEGY);
@@ -609,27 +2414,40 @@ void *compress_thread(void *(opts)) {
   // Continuously look for jobs
   for (;;) {
     // Get a job
-    job = get_job_bgn(job_queue);
+    job = get_job_worker(scheduler, worker);
     if (job == NULL)
       break;
 
-    // Initialize and set compression level.
-    (void)deflateReset(&strm);
-    (void)deflateParams(&strm, level, Z_DEFAULT_STRATEGY);
+    start = now_ns();
+    kind = job->in != NULL
+           ? block_strategy(job->in->buf, job->in->len, options->strategy)
+           : options->strategy == AUTO_STRATEGY ? Z_DEFAULT_STRATEGY
+           : options->strategy;
+    job_level = -1;
+    if (kind == STORED_BLOCK)
+      store_engine(job);
+    else {
+      // Initialize and set compression level and strategy, the level set by
+      // the scheduler if it is holding a target rate.
+      job_level = scheduler_level(scheduler);
+      if (job_level < 0)
+        job_level = level;
+      (void)deflateReset(&strm);
+      (void)deflateParams(&strm, job_level, kind);
+      job->kind = kind;
+      job->level = job_level;
+
+      // Set dictionary if there is one
+      if (job->dict != NULL) {
+        // a short read can leave less than a full dictionary in the previous block
+        size_t len = job->dict->len < DICT ? job->dict->len : DICT;
+        deflateSetDictionary(&strm, job->dict->buf + job->dict->len - len, len);
+      }
 
-    // Set dictionary if there is one
-    if (job->dict != NULL) {
-      deflateSetDictionary(&strm, job->dict->buf, job->dict->len);
+      // compress, computing the check value along the way
+      deflate_engine(&strm, job);
     }
-
-    //compress
-    deflate_engine(&strm, job);
-
-
-    //calculate check value
-    u_int32_t crc = crc32_z(0L, Z_NULL, 0);
-    crc = crc32_z(crc, job->in->buf, job->in->len);
-    job->check = crc;
+    account_job(scheduler, worker, job->len, now_ns() - start, job_level);
     // insert write job in list in sorted order, alert write thread
     //fprintf(stderr,"Adding job with seq %ld", job->seq);
     finished_processing(job);
@@ -639,162 +2457,263 @@ void *compress_thread(void *(opts)) {
   // found job with seq == -1 -- return to join
   close_job_queue(write_q);
   (void)deflateEnd(&strm);
+  arena_free(&arena);
   return NULL;
 }
 
 
-// Write len bytes, repeating write() calls as needed. Return len.
-size_t writen(int desc, void const *buf, size_t len) {
-    char const *next = buf;
-    size_t left = len;
-
-    while (left) {
-        size_t const max = SIZE_MAX >> 1;       // max ssize_t
-        ssize_t ret = write(desc, next, left > max ? max : left);
-        next += ret;
-        left -= (size_t)ret;
+// Most buffers the writer hands to one writev(): the jobs of a batch plus
+// the gzip header, file name and trailer.
+#define BATCH_IOV 64
+
+// Write all of iov[0..cnt-1], repeating writev() calls after short writes
+// and interrupts, and waiting for room on a non-blocking descriptor. iov is
+// consumed. Return 0, or -1 with errno set on a write error.
+static int writev_all(int desc, struct iovec *iov, int cnt) {
+    while (cnt) {
+        ssize_t ret = writev(desc, iov, cnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd wait = { desc, POLLOUT, 0 };
+                poll(&wait, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        // skip what was written
+        while (cnt && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
-    return len;
+    return 0;
 }
 
-unsigned put(int out, ...) {
-    // compute the total number of bytes
-    unsigned count = 0;
-    int n;
-    va_list ap;
-    va_start(ap, out);
-    while ((n = va_arg(ap, int)) != 0) {
-        va_arg(ap, val_t);
-        count += (unsigned)abs(n);
-    }
-    va_end(ap);
-
-    // allocate memory for the data
-    unsigned char* wrap = Malloc(count);
-    //unsigned char *wrap = alloc(NULL, count);
-    unsigned char *next = wrap;
-
-    // write the requested data to wrap[]
-    va_start(ap, out);
-    while ((n = va_arg(ap, int)) != 0) {
-        val_t val = va_arg(ap, val_t);
-        if (n < 0) {            // big endian
-            n = -n << 3;
-            do {
-                n -= 8;
-                *next++ = (unsigned char)(val >> n);
-            } while (n);
-        }
-        else                    // little endian
-            do {
-                *next++ = (unsigned char)val;
-                val >>= 8;
-            } while (--n);
-    }
-    va_end(ap);
-
-    // write wrap[] to out and return the number of bytes written
-    writen(out, wrap, count);
-    free(wrap);
-    return count;
-}
-
-length_t put_header(int outfd, char* name, time_t mtime, int level) {
-    length_t len;
-
-    len = put(outfd,
-        1, (val_t)31,
-        1, (val_t)139,
-        1, (val_t)8,            // deflate
-        1, (val_t)(name != NULL ? 8 : 0),
-        4, (val_t)mtime,
-        1, (val_t)(level >= 9 ? 2 : level == 1 ? 4 : 0),
-        1, (val_t)3,            // unix
-        0);
-    if (name != NULL)
-        len += writen(outfd, name, strlen(name) + 1);
-
-    return len;
+// Store n bytes of val in buf, least significant first. Return buf + n.
+static unsigned char *put_le(unsigned char *buf, val_t val, int n) {
+    do {
+        *buf++ = (unsigned char)val;
+        val >>= 8;
+    } while (--n);
+    return buf;
 }
 
-void put_trailer(int outfd, length_t ulen, unsigned long check) {
-    put(outfd,
-        4, (val_t)check,
-        4, (val_t)ulen,
-        0);
+// Encode the fixed ten bytes of a gzip header in buf; the file name, if
+// any, follows it in the output. Return the length.
+static size_t put_header(unsigned char *buf, char *name, time_t mtime,
+                         int level) {
+    unsigned char *next = buf;
+    *next++ = 31;
+    *next++ = 139;
+    *next++ = 8;                // deflate
+    *next++ = name != NULL ? 8 : 0;
+    next = put_le(next, (val_t)mtime, 4);
+    *next++ = level >= 9 ? 2 : level == 1 ? 4 : 0;
+    *next++ = 3;                // unix
+    return next - buf;
 }
 
+// Encode the gzip trailer in buf and return its length.
+static size_t put_trailer(unsigned char *buf, length_t ulen,
+                          unsigned long check) {
+    unsigned char *next = buf;
+    next = put_le(next, (val_t)check, 4);
+    next = put_le(next, (val_t)ulen, 4);
+    return next - buf;
+}
 
+// What the writer needs to know about one output file, and what it reports
+// back once the file is done.
+// Write a whole gzip stream, whose compressed data is the len bytes at
+// data, to outfd in one go. Return 0, or -1 with errno set on a write error.
+int write_gzip(int outfd, char *name, time_t mtime, int level,
+               unsigned char *data, size_t len, length_t ulen,
+               unsigned long check) {
+    struct iovec iov[4];
+    unsigned char head[10], tail[8];
+    int cnt = 0;
+
+    iov[cnt].iov_base = head;
+    iov[cnt++].iov_len = put_header(head, name, mtime, level);
+    if (name != NULL) {
+        iov[cnt].iov_base = name;
+        iov[cnt++].iov_len = strlen(name) + 1;
+    }
+    iov[cnt].iov_base = data;
+    iov[cnt++].iov_len = len;
+    iov[cnt].iov_base = tail;
+    iov[cnt++].iov_len = put_trailer(tail, ulen, check);
+    return writev_all(outfd, iov, cnt);
+}
 
 struct write_opts {
-  job_queue_t *jobqueue;
   int outfd;
   char *name;
   time_t mtime;
   int level;
+  size_t batch;                 // bytes of output to gather per writev()
+  int error;                    // errno of the first failed write, or 0
+  unsigned long writes;         // writev() batches issued
+  unsigned long blocks[BLOCK_KINDS]; // blocks compressed each way
+  unsigned long levels[10];     // blocks deflated at each level
+  condition_t *done;            // set once the trailer is out
 };
 
-write_opts *new_write_options(job_queue_t *jobqueue, int outfd, char *name, time_t mtime, int level)
+write_opts *new_write_options(int outfd, char *name, time_t mtime, int level, size_t batch)
 {
   write_opts *wopts = Malloc(sizeof(write_opts));
-  wopts->jobqueue = jobqueue;
   wopts->outfd = outfd;
-  wopts->name = name;
+  // the header may be written after the caller's copy of the name is gone
+  wopts->name = NULL;
+  if (name != NULL)
+    wopts->name = strcpy(Malloc(strlen(name) + 1), name);
   wopts->mtime = mtime;
   wopts->level = level;
+  wopts->batch = batch;
+  wopts->error = 0;
+  wopts->writes = 0;
+  memset(wopts->blocks, 0, sizeof wopts->blocks);
+  memset(wopts->levels, 0, sizeof wopts->levels);
+  wopts->done = new_condition();
   return wopts;
 }
 
+// Wait until the writer has written the whole file. Return the errno of its
+// first failed write, or 0 if there was none, and set *writes to the number
+// of batches written.
+int write_status(write_opts *write_options, unsigned long *writes)
+{
+  wait_condition(write_options->done);
+  *writes = write_options->writes;
+  return write_options->error;
+}
+
+// Report how many of the file's blocks were compressed each way, indexed by
+// BLOCK_INDEX of the zlib strategy or STORED_BLOCK. Only valid once
+// write_status has returned.
+void write_blocks(write_opts *write_options,
+                  unsigned long blocks[BLOCK_KINDS])
+{
+  memcpy(blocks, write_options->blocks, sizeof write_options->blocks);
+}
+
+// Report how many of the file's blocks were deflated at each level. Only
+// valid once write_status has returned.
+void write_levels(write_opts *write_options, unsigned long levels[10])
+{
+  memcpy(levels, write_options->levels, sizeof write_options->levels);
+}
+
+// Return nonzero if the writer has written the whole file, without waiting.
+int write_done(write_opts *write_options)
+{
+  condition_t *done = write_options->done;
+  int ready;
+  pthread_mutex_lock(done->mutex);
+  ready = done->ready;
+  pthread_mutex_unlock(done->mutex);
+  return ready;
+}
+
 void free_write_options(write_opts *write_options)
 {
+  free_condition(write_options->done);
+  free(write_options->name);
   free(write_options);
 }
 
 
+// Write each file's gzip header, compressed blocks and trailer, in sequence
+// order, until the job queue is closed. Whatever consecutive blocks are
+// already done when the writer gets to them go out together in one writev(),
+// up to the file's batch size, with the header in the first batch and the
+// trailer in the last. After a write error the rest of that file's jobs are
+// still collected and freed, but not written.
 void* write_thread(void *opts) {
-    struct write_opts *w_opts;
-    long seq;
-    struct job_queue_t *jobqueue;
-    int outfd;
-    char *name;
-    time_t mtime;
-    int level;
+    job_queue_t *jobqueue = opts;
+    write_opts *file = NULL;
+    struct iovec iov[BATCH_IOV];
+    job_t *batch[BATCH_IOV];
+    unsigned char head[10], tail[8];
     struct job_t* job;
-    size_t input_len;
+    long seq = 0;
     int more = 1;
-    length_t ulen;
-    length_t clen;
-    u_int32_t final_check = crc32_z(0L, Z_NULL, 0);
-
-    w_opts = (struct write_opts*) opts;
-    jobqueue = w_opts->jobqueue;
-    outfd = w_opts->outfd;
-    name = w_opts->name;
-    mtime = w_opts->mtime;
-    level = w_opts->level;
-
-
-    put_header(outfd, name, mtime, level);
-    ulen = clen = 0;
-    seq = 0;
+    int cnt, jobs, i;
+    size_t bytes;
+    uint64_t start;
+    length_t ulen = 0;
+    u_int32_t final_check = 0;
 
-    while (more)
+    for (;;)
       {
         job = get_job_seq(jobqueue, seq);
-	//printf("%u\n", job->check);
-	if (job == NULL)
-	  break;
-        input_len = job->in->len;
-        ulen += input_len;
-        clen += job->out->len;
-	more = job->more;
-        writen(outfd, job->out->buf, job->out->len);
-        final_check = crc32_combine(final_check, job->check, job->in->len);
-	//printf("%u\n", final_check);
-        free_job(job);
-        seq++;
+        if (job == NULL)
+          break;
+        cnt = 0;
+        if (file == NULL)
+          {
+            // first block of a file
+            file = job->file;
+            ulen = 0;
+            final_check = 0;    // CRC-32 of no data, as for crc32_update
+            iov[cnt].iov_base = head;
+            iov[cnt++].iov_len = put_header(head, file->name, file->mtime,
+                                            file->level);
+            if (file->name != NULL) {
+                iov[cnt].iov_base = file->name;
+                iov[cnt++].iov_len = strlen(file->name) + 1;
+            }
+          }
+        bytes = 0;
+        jobs = 0;
+        while (job != NULL)
+          {
+            assert(job->file == file);
+            batch[jobs++] = job;
+            iov[cnt].iov_base = job->out->buf;
+            iov[cnt++].iov_len = job->out->len;
+            bytes += job->out->len;
+            ulen += job->len;
+            file->blocks[BLOCK_INDEX(job->kind)]++;
+            if (job->kind != STORED_BLOCK)
+              file->levels[job->level]++;
+            final_check = crc32_combine(final_check, job->check, job->len);
+            more = job->more;
+            seq++;
+            // leave room for the trailer
+            if (!more || cnt == BATCH_IOV - 1 || bytes >= file->batch)
+              break;
+            job = try_get_job_seq(jobqueue, seq);
+          }
+        if (!more)
+          {
+            iov[cnt].iov_base = tail;
+            iov[cnt++].iov_len = put_trailer(tail, ulen, final_check);
+          }
+        if (file->error == 0)
+          {
+            start = now_ns();
+            if (writev_all(file->outfd, iov, cnt) < 0)
+              file->error = errno;
+            account_write(jobqueue, now_ns() - start);
+            file->writes++;
+          }
+        for (i = 0; i < jobs; i++)
+          free_job(batch[i]);
+        if (!more)
+          {
+            // the reader may free file as soon as it hears about it
+            write_opts *done = file;
+            file = NULL;
+            broadcast_condition(done->done);
+          }
       }
-    //printf("%u\n", final_check);
-    put_trailer(outfd, ulen, final_check);
     return NULL;
 }
@@ -1,9 +1,15 @@
+#include <stdint.h>
+
 struct lock_t;
 struct condition_t;
 struct space_t;
 struct pool_t;
 struct job_t;
 struct job_queue_t;
+struct map_window_t;
+struct input_map_t;
+struct scheduler_t;
+struct numa_t;
 struct compress_options;
 struct write_opts;
 
@@ -13,11 +19,25 @@ typedef struct space_t space_t;
 typedef struct pool_t pool_t;
 typedef struct job_t job_t;
 typedef struct job_queue_t job_queue_t;
+typedef struct map_window_t map_window_t;
+typedef struct input_map_t input_map_t;
+typedef struct scheduler_t scheduler_t;
+typedef struct numa_t numa_t;
 typedef struct compress_options compress_options;
 typedef unsigned long length_t;
 typedef length_t val_t;
 typedef struct write_opts write_opts;
 
+// How a block is compressed: deflated with one of zlib's strategies, which
+// are 0 (Z_DEFAULT_STRATEGY) to 4 (Z_FIXED), or copied out stored, which is
+// kept out of their range. Blocks are counted by kind at BLOCK_INDEX(kind):
+// the strategies at their own number and stored blocks after them.
+#define STORED_BLOCK (-2)
+#define BLOCK_KINDS 6
+#define BLOCK_INDEX(kind) ((kind) == STORED_BLOCK ? BLOCK_KINDS - 1 : (kind))
+// Pick the strategy for each block from its contents.
+#define AUTO_STRATEGY (-1)
+
 lock_t *new_lock(unsigned int users, int fixed_size);
 void get_lock(lock_t* lock);
 void release_lock(lock_t* lock);
@@ -33,36 +53,84 @@ void free_condition(condition_t *condition);
 
 space_t *new_space(int size);
 void free_space(space_t *space);
-pool_t* new_pool(size_t size, int limit);
+pool_t* new_pool(size_t size, int limit, int huge, int node);
 space_t *get_space(pool_t *pool);
+void use_space(space_t *space);
 void drop_space(space_t* space);
 void free_pool(pool_t* pool);
+void pool_stats (pool_t *pool, int *made, int *high, int *limit);
+size_t pool_memory (size_t size, int limit, int huge);
+size_t arena_memory (int huge);
+void memory_usage (size_t *used, size_t *peak);
+
+numa_t *new_numa (void);
+void free_numa (numa_t *numa);
+int numa_nodes (numa_t *numa);
+int numa_node_id (numa_t *numa, int node);
 
-job_t *new_job (long seq, pool_t *in_pool, pool_t *out_pool);
+int default_processes (void);
+double cpu_quota (void);
+int cpu_throttling (unsigned long long *periods, unsigned long long *throttled,
+                    uint64_t *ns);
+
+input_map_t *new_input_map (int fd, off_t start, off_t end);
+size_t map_job (input_map_t *map, job_t *job, size_t len);
+unsigned char const *map_peek (input_map_t *map, size_t *len);
+off_t input_map_pos (input_map_t *map);
+int input_map_shrunk (input_map_t *map);
+void free_input_map (input_map_t *map);
+
+job_t *new_job (long seq, write_opts *file, pool_t *in_pool, pool_t *out_pool);
 void set_last_job (job_t *job);
-int load_job (job_t *job, int input_fd);
+size_t load_job (job_t *job, int input_fd, size_t len);
+size_t cut_job (job_t *job);
+void carry_job (job_t *prev_job, job_t *next_job, size_t len);
 void finished_processing (job_t *job);
 void free_job (job_t *job);
-void set_dictionary (job_t *prev_job, job_t *next_job, pool_t *dict_pool);
+void set_dictionary (job_t *prev_job, job_t *next_job);
 
-job_queue_t* new_job_queue (int num_threads, int ordered);
+job_queue_t* new_job_queue (int num_threads, int ordered, size_t capacity);
 void close_job_queue (job_queue_t *job_q);
 void free_job_queue (job_queue_t *job_q); // not thread safe
 job_t *get_job_bgn (job_queue_t *job_q);
-job_t* get_job_seq (job_queue_t* job_q, int seq);
+job_t* get_job_seq (job_queue_t* job_q, long seq);
+job_t* try_get_job_seq (job_queue_t* job_q, long seq);
+void write_pressure (job_queue_t *job_q, uint64_t *write_ns, uint64_t *wait_ns,
+                     long *depth);
 
 void add_job_bgn (job_queue_t *job_q, job_t *job);
 void add_job_end (job_queue_t *job_q, job_t *job);
 
-write_opts *new_write_options(job_queue_t *job_queue, int outfd, char *name, time_t mtime, int level);
-compress_options *new_compress_options (job_queue_t *job_queue, job_queue_t* write_job_queue, int level);
+scheduler_t *new_scheduler (int workers, size_t capacity);
+void free_scheduler (scheduler_t *sched); // not thread safe
+void schedule_job (scheduler_t *sched, job_t *job);
+void scheduler_place (scheduler_t *sched, int worker, int node);
+int scheduler_node (scheduler_t *sched, unsigned long ahead);
+void close_scheduler (scheduler_t *sched);
+job_t *get_job_worker (scheduler_t *sched, int worker);
+void scheduler_target (scheduler_t *sched, double rate, int level);
+void scheduler_boost (scheduler_t *sched, job_queue_t *write_q, int level);
+int scheduler_level (scheduler_t *sched);
+void scheduler_changes (scheduler_t *sched, unsigned long *raises,
+                        unsigned long *drops);
+void scheduler_clear_changes (scheduler_t *sched);
+void account_job (scheduler_t *sched, int worker, size_t len, uint64_t ns, int level);
+void scheduler_rate (scheduler_t *sched, uint64_t *bytes, uint64_t *ns);
+void print_scheduler_stats (scheduler_t *sched, FILE *stream);
+uint64_t now_ns (void);
+
+write_opts *new_write_options(int outfd, char *name, time_t mtime, int level, size_t batch);
+int write_status(write_opts *wopts, unsigned long *writes);
+void write_blocks(write_opts *wopts, unsigned long blocks[BLOCK_KINDS]);
+void write_levels(write_opts *wopts, unsigned long levels[10]);
+int write_done(write_opts *wopts);
+compress_options *new_compress_options (scheduler_t *scheduler, int worker, job_queue_t* write_job_queue, int level, int strategy, numa_t *numa, int node, int huge);
+size_t rsync_cut (unsigned char const *buf, size_t len);
+int block_strategy (unsigned char const *buf, size_t len, int strategy);
 void free_compress_options(compress_options *copts);
 void free_write_options(write_opts *wopts);
 void deflate_engine (z_stream *strm, job_t *job);
 void *compress_thread(void *dummy);
 
-size_t writen(int desc, void const *buf, size_t len);
-unsigned put(int out, ...);
-length_t put_header(int outfd, char* name, time_t mtime, int level);
-void put_trailer(int outfd, length_t ulen, unsigned long check);
+int write_gzip(int outfd, char *name, time_t mtime, int level, unsigned char *data, size_t len, length_t ulen, unsigned long check);
 void *write_thread(void *opts);
@@ -125,12 +125,15 @@ int unzip(in, out)
         if (ret == -1)
             exit (EXIT_FAILURE);
       }
+    int err;
     bytes_in = 0;
     bytes_out = 0;
     if (in != STDIN_FILENO)
-        inflate_file (in, out, &bytes_in, &bytes_out);
+        err = inflate_file (in, out, &bytes_in, &bytes_out);
     else
-        inflate_file (temp_fd, out, &bytes_in, &bytes_out);
+        err = inflate_file (temp_fd, out, &bytes_in, &bytes_out);
+    if (err)
+        gzip_error ("invalid compressed data--crc error");
     inptr = insize;
     return OK;
 }
@@ -53,6 +53,17 @@ void *Malloc(size_t size)
    return addr;
 }
 
+void *Memalign (size_t alignment, size_t size)
+{
+  void *addr = NULL;
+  if (posix_memalign (&addr, alignment, size) != 0)
+    {
+      printf ("Insufficient memory");
+      assert (addr != NULL);
+    }
+  return addr;
+}
+
 void Unlink (const char* pathname)
 {
   assert (unlink (pathname) == 0);
@@ -23,3 +23,4 @@ ssize_t Read(int fd, void *buf, size_t count);
 void Unlink (const char* pathname);
 void *Malloc(size_t size);
 void *Calloc (size_t nelem, size_t elsize);
+void *Memalign (size_t alignment, size_t size);
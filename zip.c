@@ -28,8 +28,13 @@
 local ulg crc;       /* crc on uncompressed file data */
 off_t header_bytes;   /* number of bytes in gzip header */
 
+int zip_defer = 0;
+struct deflate_file *zip_pending = NULL;
+
 /* ===========================================================================
- * Deflate in to out.
+ * Deflate in to out.  If zip_defer is set, return once all of the input has
+ * been read, leaving the output to be finished with deflate_end on
+ * zip_pending.
  * IN assertions: the input and output buffers are cleared.
  *   The variables time_stamp and save_orig_name are initialized.
  */
@@ -79,7 +84,14 @@ int zip(in, out)
     //header_bytes += 2*4;
 
     char name[16] = "compressed_file";
-    deflate_file_parallel(in, out, 1024*128, processes, level, name, 0);
+    if (0 <= ifile_size && ifile_size <= SMALL_FILE
+        && deflate_small(in, out, level, name, 0) == 0)
+        return OK;
+    if (zip_defer)
+        zip_pending = deflate_begin(in, out, block_size, processes, level,
+                                    name, 0);
+    else
+        deflate_file_parallel(in, out, block_size, processes, level, name, 0);
     return OK;
 }
 